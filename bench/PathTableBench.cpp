@@ -0,0 +1,90 @@
+// Compare the throughput of the runtime path table against the
+// unordered_map based storage it replaced.
+//
+// Usage: epp-bench-pathtable [functions] [paths per function] [log calls]
+
+#include <chrono>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+#include "PathTable.h"
+
+using namespace std;
+using namespace epp;
+
+namespace {
+
+/// The original runtime storage, EPP(data)::log.
+struct MapData {
+    vector<unordered_map<uint64_t, uint64_t>> Data;
+    explicit MapData(uint32_t N) : Data(N) {}
+    void log(uint64_t Val, uint64_t FunctionId) {
+        Data[FunctionId][Val] += 1;
+    }
+    uint64_t checksum() const {
+        uint64_t Sum = 0;
+        for (auto &M : Data)
+            for (auto &KV : M)
+                Sum += KV.first * KV.second;
+        return Sum;
+    }
+};
+
+struct TableData {
+    vector<PathTable> Data;
+    explicit TableData(uint32_t N) : Data(N) {}
+    void log(uint64_t Val, uint64_t FunctionId) { Data[FunctionId].inc(Val); }
+    uint64_t checksum() const {
+        uint64_t Sum = 0;
+        for (auto &T : Data)
+            T.forEach([&Sum](uint64_t K, uint64_t C) { Sum += K * C; });
+        return Sum;
+    }
+};
+
+template <typename T>
+double run(const char *Name, uint32_t Functions,
+           const vector<pair<uint64_t, uint32_t>> &Trace) {
+    T Storage(Functions);
+    auto Start = chrono::steady_clock::now();
+    for (auto &E : Trace) {
+        Storage.log(E.first, E.second);
+    }
+    auto End = chrono::steady_clock::now();
+    double Secs = chrono::duration<double>(End - Start).count();
+    double Rate = Trace.size() / Secs;
+    printf("%-16s %10.3f ms %12.2f Mlookups/s (checksum %" PRIx64 ")\n", Name,
+           Secs * 1e3, Rate / 1e6, Storage.checksum());
+    return Rate;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+    uint32_t Functions = argc > 1 ? strtoul(argv[1], nullptr, 10) : 64;
+    uint64_t Paths     = argc > 2 ? strtoull(argv[2], nullptr, 10) : 4096;
+    uint64_t Calls     = argc > 3 ? strtoull(argv[3], nullptr, 10) : 20000000;
+
+    // Path frequencies in real programs are heavily skewed, model this
+    // with a geometric distribution over the path ids of each function.
+    mt19937_64 Gen(42);
+    uniform_int_distribution<uint32_t> Func(0, Functions - 1);
+    geometric_distribution<uint64_t> Path(8.0 / Paths);
+    vector<pair<uint64_t, uint32_t>> Trace;
+    Trace.reserve(Calls);
+    for (uint64_t I = 0; I < Calls; I++) {
+        Trace.emplace_back(Path(Gen) % Paths, Func(Gen));
+    }
+
+    printf("functions: %u paths/function: %" PRIu64 " calls: %" PRIu64 "\n",
+           Functions, Paths, Calls);
+    double Base = run<MapData>("unordered_map", Functions, Trace);
+    double New  = run<TableData>("PathTable", Functions, Trace);
+    printf("speedup: %.2fx\n", New / Base);
+    return 0;
+}
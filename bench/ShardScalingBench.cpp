@@ -0,0 +1,134 @@
+// Measure how path counting scales with the number of threads for the
+// different ways of sharing counters between threads:
+//  - a single shared hash map guarded by a mutex
+//  - a single shared counter array updated with relaxed atomics
+//  - per thread, cache line aligned counter shards reduced at the end
+//
+// Usage: epp-bench-shards [max threads] [increments per thread] [paths]
+
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "PathTable.h"
+
+using namespace std;
+using namespace epp;
+
+namespace {
+
+struct SharedMap {
+    mutex Lock;
+    PathTable Table;
+    explicit SharedMap(uint64_t) {}
+    void log(uint64_t Path) {
+        lock_guard<mutex> L(Lock);
+        Table.inc(Path);
+    }
+    uint64_t total() {
+        uint64_t Sum = 0;
+        Table.forEach([&Sum](uint64_t, uint64_t C) { Sum += C; });
+        return Sum;
+    }
+};
+
+struct AtomicArray {
+    vector<atomic<uint64_t>> Counts;
+    explicit AtomicArray(uint64_t Paths) : Counts(Paths) {
+        for (auto &C : Counts)
+            C.store(0);
+    }
+    void log(uint64_t Path) {
+        Counts[Path].fetch_add(1, memory_order_relaxed);
+    }
+    uint64_t total() {
+        uint64_t Sum = 0;
+        for (auto &C : Counts)
+            Sum += C.load();
+        return Sum;
+    }
+};
+
+// Mirrors the shards handed out by __epp_shardInit.
+struct ShardedArray {
+    uint64_t Paths;
+    mutex Lock;
+    vector<uint64_t *> Shards;
+    static thread_local uint64_t *Shard;
+    explicit ShardedArray(uint64_t P) : Paths(P) {}
+    ~ShardedArray() {
+        for (auto *S : Shards)
+            free(S);
+    }
+    void log(uint64_t Path) {
+        if (!Shard) {
+            size_t Bytes = (Paths * sizeof(uint64_t) + 63) & ~size_t(63);
+            void *Mem    = nullptr;
+            if (posix_memalign(&Mem, 64, Bytes))
+                abort();
+            memset(Mem, 0, Bytes);
+            Shard = static_cast<uint64_t *>(Mem);
+            lock_guard<mutex> L(Lock);
+            Shards.push_back(Shard);
+        }
+        Shard[Path]++;
+    }
+    uint64_t total() {
+        uint64_t Sum = 0;
+        for (auto *S : Shards)
+            for (uint64_t P = 0; P < Paths; P++)
+                Sum += S[P];
+        return Sum;
+    }
+};
+thread_local uint64_t *ShardedArray::Shard = nullptr;
+
+template <typename T>
+double run(unsigned Threads, uint64_t Iters, uint64_t Paths) {
+    T Counters(Paths);
+    vector<thread> Workers;
+    auto Start = chrono::steady_clock::now();
+    for (unsigned I = 0; I < Threads; I++) {
+        Workers.emplace_back([&Counters, Iters, Paths, I]() {
+            uint64_t X = I + 1;
+            for (uint64_t J = 0; J < Iters; J++) {
+                X = X * 6364136223846793005ULL + 1442695040888963407ULL;
+                Counters.log((X >> 33) % Paths);
+            }
+        });
+    }
+    for (auto &W : Workers)
+        W.join();
+    auto End = chrono::steady_clock::now();
+    if (Counters.total() != Threads * Iters) {
+        fprintf(stderr, "lost updates\n");
+    }
+    // Report the aggregate rate, ideal scaling is linear in threads.
+    return Threads * Iters / chrono::duration<double>(End - Start).count();
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+    unsigned MaxThreads = argc > 1 ? strtoul(argv[1], nullptr, 10)
+                                   : thread::hardware_concurrency();
+    uint64_t Iters = argc > 2 ? strtoull(argv[2], nullptr, 10) : 10000000;
+    uint64_t Paths = argc > 3 ? strtoull(argv[3], nullptr, 10) : 16;
+
+    printf("%8s %16s %16s %16s   (Mlogs/s)\n", "threads", "shared-map",
+           "atomic-array", "sharded-array");
+    for (unsigned T = 1; T <= MaxThreads; T *= 2) {
+        printf("%8u %16.2f %16.2f %16.2f\n", T,
+               run<SharedMap>(T, Iters, Paths) / 1e6,
+               run<AtomicArray>(T, Iters, Paths) / 1e6,
+               run<ShardedArray>(T, Iters, Paths) / 1e6);
+    }
+    return 0;
+}
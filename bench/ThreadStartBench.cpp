@@ -0,0 +1,110 @@
+// Measure the cost of registering threads with the profiling runtime on a
+// program with many functions: the time until a new thread has logged its
+// first paths and the resident memory once all threads are alive. Each
+// thread touches a handful of functions, as threads in large programs do.
+//
+// Usage: epp-bench-threads [functions] [threads] [functions per thread]
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// Normally defined by the instrumented module, see
+// EPPProfile::addCtorsAndDtors.
+extern "C" {
+uint32_t __epp_numberOfFunctions = 200000;
+uint64_t __epp_shardWords        = 0;
+void __epp_init(uint32_t NumberOfFunctions, uint32_t Format, char *Path);
+void __epp_logPath(uint64_t Val, uint64_t FunctionId);
+}
+
+namespace {
+
+/// Resident set size of the process in KB.
+long residentKB() {
+    FILE *Fp = fopen("/proc/self/status", "r");
+    if (!Fp) {
+        return -1;
+    }
+    char Line[256];
+    long KB = -1;
+    while (fgets(Line, sizeof(Line), Fp)) {
+        if (!strncmp(Line, "VmRSS:", 6)) {
+            KB = atol(Line + 6);
+            break;
+        }
+    }
+    fclose(Fp);
+    return KB;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    uint32_t Functions = argc > 1 ? atoi(argv[1]) : 200000;
+    uint32_t Threads   = argc > 2 ? atoi(argv[2]) : 256;
+    uint32_t PerThread = argc > 3 ? atoi(argv[3]) : 8;
+
+    __epp_numberOfFunctions = Functions;
+    char Path[]             = "/dev/null";
+    __epp_init(Functions, 0, Path);
+
+    long Before = residentKB();
+
+    mutex Lock;
+    condition_variable Done;
+    uint32_t Started = 0;
+    bool Release     = false;
+    vector<double> StartupUs(Threads);
+
+    vector<thread> Pool;
+    for (uint32_t T = 0; T < Threads; T++) {
+        auto Spawn = chrono::steady_clock::now();
+        Pool.emplace_back([&, T, Spawn] {
+            for (uint32_t I = 0; I < PerThread; I++) {
+                __epp_logPath(I, (uint64_t(T) * 7919 + I * 104729) % Functions);
+            }
+            StartupUs[T] = chrono::duration<double, micro>(
+                               chrono::steady_clock::now() - Spawn)
+                               .count();
+            unique_lock<mutex> L(Lock);
+            Started++;
+            Done.notify_all();
+            Done.wait(L, [&] { return Release; });
+        });
+    }
+
+    {
+        unique_lock<mutex> L(Lock);
+        Done.wait(L, [&] { return Started == Threads; });
+    }
+    long After = residentKB();
+    {
+        lock_guard<mutex> L(Lock);
+        Release = true;
+    }
+    Done.notify_all();
+    for (auto &T : Pool) {
+        T.join();
+    }
+
+    double Sum = 0, Max = 0;
+    for (double Us : StartupUs) {
+        Sum += Us;
+        Max = Us > Max ? Us : Max;
+    }
+    printf("functions: %u threads: %u functions/thread: %u\n", Functions,
+           Threads, PerThread);
+    printf("thread startup: mean %.1f us, max %.1f us\n", Sum / Threads, Max);
+    printf("rss growth with all threads alive: %ld KB (%.1f KB/thread)\n",
+           After - Before, double(After - Before) / Threads);
+    return 0;
+}
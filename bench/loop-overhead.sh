@@ -0,0 +1,48 @@
+#!/bin/sh
+# Compare the run time of the loop kernels in bench/loops without
+# instrumentation, with the default __epp_logPath call and with the
+# preserve_most entry point (llvm-epp -preserve-most).
+#
+# Usage: loop-overhead.sh <build dir> [trip count]
+#
+# clang and llvm-epp must be on the PATH, <build dir> is used to find
+# libepp-rt.
+
+set -e
+
+BUILD=$(cd "${1:?usage: loop-overhead.sh <build dir> [trip count]}" && pwd)
+N=${2:-100000000}
+SRCDIR=$(cd "$(dirname "$0")/loops" && pwd)
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+export LD_LIBRARY_PATH="$BUILD/lib:$LD_LIBRARY_PATH"
+
+now() { date +%s.%N; }
+
+timeit() {
+    START=$(now)
+    "$@" > /dev/null
+    END=$(now)
+    echo "$END - $START" | bc
+}
+
+printf "%-20s %12s %12s %18s\n" kernel "base (s)" "call (s)" "preserve_most (s)"
+for SRC in "$SRCDIR"/*.c; do
+    NAME=$(basename "$SRC" .c)
+    cd "$WORK"
+    clang -O2 -c -emit-llvm "$SRC" -o "$NAME.bc"
+    clang -O2 "$NAME.bc" -o "$NAME.base"
+
+    llvm-epp "$NAME.bc" -o "$NAME.call.txt" 2> /dev/null
+    clang -O2 "$NAME.epp.bc" -o "$NAME.call" -L"$BUILD/lib" -lepp-rt
+
+    llvm-epp -preserve-most "$NAME.bc" -o "$NAME.pm.txt" 2> /dev/null
+    clang -O2 "$NAME.epp.bc" -o "$NAME.pm" -L"$BUILD/lib" -lepp-rt
+
+    printf "%-20s %12s %12s %18s\n" "$NAME" \
+        "$(timeit ./"$NAME.base" "$N" 1)" \
+        "$(timeit ./"$NAME.call" "$N" 1)" \
+        "$(timeit ./"$NAME.pm" "$N" 1)"
+    cmp -s "$NAME.call.txt" "$NAME.pm.txt" || echo "  profiles differ!"
+done
@@ -0,0 +1,12 @@
+// Same CFG as test/srcs/05-loop.c with a configurable trip count.
+#include <stdlib.h>
+
+volatile unsigned long Sink;
+
+int main(int argc, char *argv[]) {
+    long N = argc > 1 ? atol(argv[1]) : 100000000;
+    for (long i = 0; i < N; i++) {
+        Sink += i;
+    }
+    return 0;
+}
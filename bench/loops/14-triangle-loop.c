@@ -0,0 +1,23 @@
+// Same CFG as test/srcs/14-triangle-loop.c with a configurable trip count.
+#include <stdlib.h>
+
+volatile unsigned long Sink;
+
+int main(int argc, char *argv[]) {
+    long N = argc > 1 ? atol(argv[1]) : 100000000;
+    if (argc > 2) {
+        for (long i = 0; i < N; i++) {
+            if (i % 2) {
+                Sink += i;
+            }
+        }
+    }
+
+    for (long i = 0; i < N; i++) {
+        if (i % 3) {
+            Sink += i;
+        }
+    }
+
+    return 0;
+}
@@ -17,8 +17,12 @@ namespace epp {
 struct Edge {
     BasicBlock *src, *tgt;
     bool real;
-    Edge(BasicBlock *from, BasicBlock *to, bool r = true)
-        : src(from), tgt(to), real(r) {}
+    // The successor number of a real edge in the terminator of src. A
+    // switch may branch to the same block from several cases, this tells
+    // the edges apart when they are instrumented.
+    unsigned succNum;
+    Edge(BasicBlock *from, BasicBlock *to, bool r = true, unsigned n = 0)
+        : src(from), tgt(to), real(r), succNum(n) {}
 };
 
 using EdgePtr = std::shared_ptr<Edge>;
@@ -33,12 +37,14 @@ class AuxGraph {
     DenseMap<const BasicBlock *, SmallVector<EdgePtr, 4>> EdgeList;
     std::unordered_map<EdgePtr, std::pair<EdgePtr, EdgePtr>> SegmentMap;
     std::unordered_map<EdgePtr, APInt> Weights;
+    std::unordered_map<EdgePtr, APInt> Increments;
     BasicBlock *FakeExit;
 
   public:
     void clear();
     void init(Function &F);
-    EdgePtr add(BasicBlock *src, BasicBlock *tgt, bool isReal = true);
+    EdgePtr add(BasicBlock *src, BasicBlock *tgt, bool isReal = true,
+                unsigned succNum = 0);
     void
     segment(SetVector<std::pair<const BasicBlock *, const BasicBlock *>> &List);
     // void printWeights();
@@ -47,6 +53,9 @@ class AuxGraph {
     SmallVector<EdgePtr, 4> succs(BasicBlock *B) const;
     SmallVector<std::pair<EdgePtr, APInt>, 16> getWeights() const;
     APInt getEdgeWeight(const EdgePtr &Ptr) const;
+    void placeIncrements(const std::unordered_map<EdgePtr, uint64_t> &Freqs);
+    SmallVector<std::pair<EdgePtr, APInt>, 16> getIncrements() const;
+    APInt getIncrement(const EdgePtr &Ptr) const;
     std::unordered_map<EdgePtr, std::pair<EdgePtr, EdgePtr>>
     getSegmentMap() const;
     EdgePtr exists(BasicBlock *Src, BasicBlock *Tgt, bool isReal) const;
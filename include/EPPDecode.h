@@ -20,6 +20,13 @@ struct Path {
     uint64_t Freq;
     PathType Type;
     std::vector<BasicBlock *> Blocks;
+    // Error bound of Freq for functions counted approximately.
+    uint64_t Error;
+    // Increments of the path counter executed along the path, with an
+    // increment on every edge of non-zero weight and with increments on
+    // the chords of the spanning tree only (-event-counting).
+    unsigned EdgeIncs;
+    unsigned ChordIncs;
 };
 
 struct EPPDecode : public llvm::ModulePass {
@@ -41,7 +48,8 @@ struct EPPDecode : public llvm::ModulePass {
     void getPathInfo(uint32_t FunctionId, Path &Info);
 
     std::pair<PathType, std::vector<llvm::BasicBlock *>>
-    decode(llvm::Function &F, llvm::APInt pathID, EPPEncode &E);
+    decode(llvm::Function &F, llvm::APInt pathID, EPPEncode &E,
+           std::vector<EdgePtr> *Edges = nullptr);
 
     llvm::StringRef getPassName() const override { return "EPPDecode"; }
 };
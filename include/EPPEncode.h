@@ -5,6 +5,8 @@
 #include "llvm/ADT/DenseMap.h"
 #include "llvm/ADT/MapVector.h"
 #include "llvm/ADT/SetVector.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/BranchProbabilityInfo.h"
 #include "llvm/Analysis/LoopInfo.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Module.h"
@@ -19,23 +21,35 @@
 
 namespace epp {
 
+/// Add \p Data to a 64 bit FNV-1a hash. Unlike hash_combine the result is
+/// stable across runs and hosts, so it can be stored in profiles.
+uint64_t fnv1a(uint64_t Hash, llvm::StringRef Data);
+const uint64_t FNV1aOffset = 0xcbf29ce484222325ULL;
+
 struct EPPEncode : public llvm::FunctionPass {
 
     static char ID;
 
     llvm::LoopInfo *LI;
+    llvm::BlockFrequencyInfo *BFI;
+    llvm::BranchProbabilityInfo *BPI;
     llvm::DenseMap<llvm::BasicBlock *, llvm::APInt> NumPaths;
     AuxGraph AG;
 
-    EPPEncode() : llvm::FunctionPass(ID), LI(nullptr) {}
+    EPPEncode()
+        : llvm::FunctionPass(ID), LI(nullptr), BFI(nullptr), BPI(nullptr) {}
 
     virtual void getAnalysisUsage(llvm::AnalysisUsage &AU) const override {
         AU.addRequired<llvm::LoopInfoWrapperPass>();
+        AU.addRequired<llvm::BlockFrequencyInfoWrapperPass>();
+        AU.addRequired<llvm::BranchProbabilityInfoWrapperPass>();
         AU.setPreservesAll();
     }
 
     virtual bool runOnFunction(llvm::Function &F) override;
     void encode(llvm::Function &F);
+    void placeIncrements();
+    uint64_t hash(uint64_t Hash, llvm::Function &F, uint32_t FunctionId) const;
     bool doInitialization(llvm::Module &M) override;
     bool doFinalization(llvm::Module &M) override;
     void releaseMemory() override;
@@ -8,6 +8,7 @@
 #include "llvm/Pass.h"
 
 #include "EPPDecode.h"
+#include "EPPProfileFormat.h"
 #include <map>
 #include <vector>
 
@@ -24,6 +25,12 @@ struct EPPPathPrinter : public llvm::ModulePass {
     }
 
     virtual bool runOnModule(llvm::Module &m) override;
+    void checkModuleHash(llvm::Module &M, uint64_t Recorded);
+    void printEpochs(EPPDecode &D, const EpochReader &Reader);
+    void printHotPaths(
+        std::vector<std::pair<PathTime, std::pair<uint32_t, Path>>> &Timed,
+        uint64_t TotalCycles);
+    void printIncrements(uint64_t EdgeIncs, uint64_t ChordIncs);
     bool doInitialization(llvm::Module &m) override;
     llvm::StringRef getPassName() const override { return "EPPPathPrinter"; }
 };
@@ -1,20 +1,55 @@
 #ifndef EPPPROFILE_H
 #define EPPPROFILE_H
 #include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallVector.h"
 #include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/GlobalVariable.h"
 #include "llvm/IR/Module.h"
 #include "llvm/Pass.h"
 
 #include "EPPEncode.h"
 
 namespace epp {
+
+/// How the counters of an array mode function are updated.
+enum CounterMode {
+    Plain,  // A single array updated with ordinary loads and stores.
+    Atomic, // A single array updated with relaxed atomic increments.
+    Sharded // A private copy of the array per thread, reduced on dump.
+};
+
+/// A function whose paths are counted in a statically allocated array
+/// indexed by the path id rather than by the hashing runtime. Sharded
+/// functions do not have a global array, their counters live at Offset
+/// in the per thread shard allocated by the runtime. Neither do continuous
+/// functions, whose counters live at Offset in the block of continuous
+/// counters which the runtime maps from a file.
+struct ArrayCounter {
+    uint64_t FunctionId;
+    llvm::GlobalVariable *Counters;
+    uint64_t NumPaths;
+    CounterMode Mode;
+    uint64_t Offset;
+    bool Continuous;
+};
+
 struct EPPProfile : public llvm::ModulePass {
     static char ID;
 
     llvm::LoopInfo *LI;
     llvm::DenseMap<llvm::Function *, uint64_t> FunctionIds;
+    llvm::SmallVector<ArrayCounter, 16> ArrayCounters;
+    // Ids of the functions counted in heavy hitter summaries.
+    llvm::SmallVector<uint64_t, 16> HeavyHitters;
+    uint64_t ShardWords;
+    // Size of the block of continuous counters.
+    uint64_t ContinuousWords;
+    // Identifies the path numbering of the module in its profiles.
+    uint64_t ModuleHash;
 
-    EPPProfile() : llvm::ModulePass(ID), LI(nullptr) {}
+    EPPProfile()
+        : llvm::ModulePass(ID), LI(nullptr), ShardWords(0),
+          ContinuousWords(0), ModuleHash(FNV1aOffset) {}
 
     virtual void getAnalysisUsage(llvm::AnalysisUsage &au) const override {
         // au.addRequired<llvm::LoopInfoWrapperPass>();
@@ -22,7 +57,10 @@ struct EPPProfile : public llvm::ModulePass {
     }
 
     virtual bool runOnModule(llvm::Module &m) override;
-    void instrument(llvm::Function &F, EPPEncode &E);
+    void instrument(llvm::Function &F, EPPEncode &E,
+                    const ArrayCounter *AC = nullptr, bool Timed = false);
+    const ArrayCounter &allocateArrayCounter(llvm::Function &F,
+                                             uint64_t NumPaths);
     void addCtorsAndDtors(llvm::Module &Mod);
 
     bool doInitialization(llvm::Module &m) override;
@@ -0,0 +1,875 @@
+#ifndef EPPPROFILEFORMAT_H
+#define EPPPROFILEFORMAT_H
+
+// Reading and writing of path profiles. This header is shared by the
+// runtime, which writes profiles, and by llvm-epp, which reads them, so
+// it must not depend on LLVM.
+//
+// Two formats are supported.
+//
+// The text format lists each function which executed at least one path
+// as a "<function id> <number of paths>" line followed by one
+// "<path id in hex> <count>" line per path, sorted by descending count.
+// It may start with comment lines holding the profile metadata: a
+// "# module <hash in hex>" line identifying the instrumented module, which
+// the runtime only writes with EPP_MODULE_HASH=1, and for a sampled
+// profile a "# sampling <burst> <period>" line. Other lines starting with
+// '#' are ignored.
+// The paths of a function profiled with a heavy hitter summary are only
+// approximate: its header line ends with "approximate", followed by the
+// bound on the count of the unlisted paths when some were evicted, and each
+// path line has a third column with the error bound of the count. The
+// paths of a timed function, see -timed-paths, were also timed with the
+// cycle counter: its header line ends with "timed" and each path line ends
+// with the total and the largest number of cycles spent in one execution
+// of the path.
+//
+// The binary format is meant to be mapped into memory and read in place:
+//
+//   Header
+//   FunctionEntry[NumFunctions]   sorted by ascending function id
+//   Records                       for each function, NumPaths pairs of
+//                                 ULEB128(path id - previous path id),
+//                                 ULEB128(count) sorted by path id,
+//                                 followed by ULEB128(error) for
+//                                 approximate functions and by
+//                                 ULEB128(total), ULEB128(max) cycles
+//                                 for timed functions. The records of
+//                                 an approximate function start with
+//                                 ULEB128(bound)
+//
+// The records of a dense function are instead NumPaths 64 bit counts
+// indexed by path id, including the paths which did not execute. The
+// runtime maps the counters of array mode functions from such a profile
+// in continuous mode, see -continuous-counters.
+//
+// All fixed width fields are stored in host byte order, the header magic
+// doubles as a byte order check.
+//
+// An epochs file splits a run into consecutive time windows, or epochs. It
+// starts with the metadata lines of a text profile, then each epoch is a
+// "# epoch <index> <start> <end>" line, with times in milliseconds since
+// the Unix epoch, followed by the functions of a text profile holding only
+// the paths counted during the epoch.
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <numeric>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace epp {
+
+enum ProfileFormat : uint32_t { TextProfile = 0, BinaryProfile = 1 };
+
+const char ProfileMagic[8]    = {'E', 'P', 'P', 'P', 'R', 'O', 'F', '\n'};
+const uint32_t ProfileVersion = 1;
+
+struct ProfileHeader {
+    char Magic[8];
+    uint32_t Version;
+    uint32_t NumFunctions;
+    uint64_t FunctionTableOffset;
+    uint32_t SampleBurst;
+    uint32_t SamplePeriod;
+    uint64_t ModuleHash;
+};
+
+/// In a sampled profile Burst paths were logged out of every Period paths
+/// executed by each thread. A zero period means every path was logged.
+struct SamplingInfo {
+    uint32_t Burst  = 0;
+    uint32_t Period = 0;
+
+    bool sampled() const { return Period != 0; }
+    /// Factor from sampled counts to estimated execution counts.
+    double scale() const { return sampled() ? double(Period) / Burst : 1.0; }
+};
+
+/// Metadata of a profile. The module hash identifies the path numbering of
+/// the instrumented module, profiles with different hashes can not be
+/// combined. Zero means unknown.
+struct ProfileInfo {
+    SamplingInfo Sampling;
+    uint64_t ModuleHash = 0;
+};
+
+/// FunctionEntry flags.
+enum FunctionFlags : uint32_t {
+    ApproximateFunction = 1,
+    DenseFunction       = 2,
+    TimedFunction       = 4
+};
+
+struct FunctionEntry {
+    uint32_t FunctionId;
+    uint32_t Flags;
+    uint64_t NumPaths;
+    uint64_t Offset; // From the start of the file.
+    uint64_t Size;   // In bytes.
+};
+
+/// Cycles spent in the executions of a path, from the start of the path
+/// to its log site.
+struct PathTime {
+    uint64_t Total = 0;
+    uint64_t Max   = 0;
+};
+
+/// The executed paths of one function, as (path id, count) pairs. The
+/// counts of an approximate function are upper bounds, Errors then holds
+/// the error bound of each path in the same order as Paths and the paths
+/// which are not listed executed at most Bound times. Likewise Times holds
+/// the cycles spent on each path of a timed function.
+struct FunctionProfile {
+    uint32_t FunctionId;
+    std::vector<std::pair<uint64_t, uint64_t>> Paths;
+    std::vector<uint64_t> Errors;
+    std::vector<PathTime> Times;
+    uint64_t Bound = 0;
+
+    explicit FunctionProfile(uint32_t FunctionId = 0)
+        : FunctionId(FunctionId) {}
+
+    bool approximate() const { return !Errors.empty(); }
+    bool timed() const { return !Times.empty(); }
+};
+
+namespace detail {
+
+inline void writeULEB(std::vector<uint8_t> &Out, uint64_t V) {
+    do {
+        uint8_t Byte = V & 0x7f;
+        V >>= 7;
+        Out.push_back(V ? Byte | 0x80 : Byte);
+    } while (V);
+}
+
+inline bool readULEB(const uint8_t *&Pos, const uint8_t *End, uint64_t &V) {
+    V              = 0;
+    unsigned Shift = 0;
+    while (Pos < End && Shift < 64) {
+        uint8_t Byte = *Pos++;
+        V |= uint64_t(Byte & 0x7f) << Shift;
+        if (!(Byte & 0x80)) {
+            return true;
+        }
+        Shift += 7;
+    }
+    return false;
+}
+
+inline bool readNumber(const char *&Pos, const char *End, unsigned Base,
+                       uint64_t &V) {
+    while (Pos < End && *Pos == ' ') {
+        Pos++;
+    }
+    const char *Start = Pos;
+    V                 = 0;
+    for (; Pos < End; Pos++) {
+        unsigned D;
+        if (*Pos >= '0' && *Pos <= '9') {
+            D = *Pos - '0';
+        } else if (Base == 16 && *Pos >= 'a' && *Pos <= 'f') {
+            D = *Pos - 'a' + 10;
+        } else if (Base == 16 && *Pos >= 'A' && *Pos <= 'F') {
+            D = *Pos - 'A' + 10;
+        } else {
+            break;
+        }
+        V = V * Base + D;
+    }
+    return Pos != Start;
+}
+
+inline void skipLine(const char *&Pos, const char *End) {
+    while (Pos < End && *Pos != '\n') {
+        Pos++;
+    }
+    if (Pos < End) {
+        Pos++;
+    }
+}
+
+} // namespace detail
+
+/// Sort the paths of a function in the order they are written in \p Format,
+/// by descending count for text and by ascending id for binary profiles.
+/// Paths which are already in order are left alone, so the writers below
+/// are cheap for profiles sorted beforehand.
+inline void sortPaths(FunctionProfile &F, ProfileFormat Format) {
+    using PathCount = std::pair<uint64_t, uint64_t>;
+    auto Less       = [Format](const PathCount &P1, const PathCount &P2) {
+        if (Format == BinaryProfile) {
+            return P1 < P2;
+        }
+        return (P1.second > P2.second) ||
+               (P1.second == P2.second && P1.first > P2.first);
+    };
+    if (std::is_sorted(F.Paths.begin(), F.Paths.end(), Less)) {
+        return;
+    }
+    if (!F.approximate() && !F.timed()) {
+        std::sort(F.Paths.begin(), F.Paths.end(), Less);
+        return;
+    }
+
+    // Permute the errors and times along with the paths.
+    std::vector<size_t> Order(F.Paths.size());
+    std::iota(Order.begin(), Order.end(), 0);
+    std::sort(Order.begin(), Order.end(), [&](size_t I1, size_t I2) {
+        return Less(F.Paths[I1], F.Paths[I2]);
+    });
+    std::vector<PathCount> Paths;
+    std::vector<uint64_t> Errors;
+    std::vector<PathTime> Times;
+    for (size_t I : Order) {
+        Paths.push_back(F.Paths[I]);
+        if (F.approximate()) {
+            Errors.push_back(F.Errors[I]);
+        }
+        if (F.timed()) {
+            Times.push_back(F.Times[I]);
+        }
+    }
+    F.Paths  = std::move(Paths);
+    F.Errors = std::move(Errors);
+    F.Times  = std::move(Times);
+}
+
+/// Write the metadata lines which start a text profile.
+inline void writeTextHeader(FILE *Fp, const ProfileInfo &Info) {
+    if (Info.ModuleHash) {
+        fprintf(Fp, "# module %016" PRIx64 "\n", Info.ModuleHash);
+    }
+    if (Info.Sampling.sampled()) {
+        fprintf(Fp, "# sampling %u %u\n", Info.Sampling.Burst,
+                Info.Sampling.Period);
+    }
+}
+
+/// Write the paths of one function in the text format.
+inline void writeTextFunction(FILE *Fp, FunctionProfile &F) {
+    fprintf(Fp, "%u %lu", F.FunctionId, F.Paths.size());
+    if (F.approximate()) {
+        fputs(" approximate", Fp);
+        if (F.Bound) {
+            fprintf(Fp, " %" PRIu64, F.Bound);
+        }
+    }
+    fprintf(Fp, "%s\n", F.timed() ? " timed" : "");
+    sortPaths(F, TextProfile);
+    for (size_t I = 0; I < F.Paths.size(); I++) {
+        fprintf(Fp, "%016" PRIx64 " %" PRIu64, F.Paths[I].first,
+                F.Paths[I].second);
+        if (F.approximate()) {
+            fprintf(Fp, " %" PRIu64, F.Errors[I]);
+        }
+        if (F.timed()) {
+            fprintf(Fp, " %" PRIu64 " %" PRIu64, F.Times[I].Total,
+                    F.Times[I].Max);
+        }
+        fputc('\n', Fp);
+    }
+}
+
+/// Write a profile in the text format. The paths of each function are
+/// sorted by descending count, then by descending id to keep the output
+/// deterministic.
+inline void writeTextProfile(FILE *Fp, std::vector<FunctionProfile> &Profile,
+                             const ProfileInfo &Info = ProfileInfo()) {
+    writeTextHeader(Fp, Info);
+    for (auto &F : Profile) {
+        writeTextFunction(Fp, F);
+    }
+}
+
+/// Append the records of one function in the binary format to \p Records
+/// and return its function table entry, with an offset relative to the
+/// start of \p Records.
+inline FunctionEntry encodeBinaryFunction(std::vector<uint8_t> &Records,
+                                          FunctionProfile &F) {
+    sortPaths(F, BinaryProfile);
+    uint32_t Flags  = (F.approximate() ? ApproximateFunction : 0u) |
+                     (F.timed() ? TimedFunction : 0u);
+    FunctionEntry E = {F.FunctionId, Flags, F.Paths.size(), Records.size(),
+                       0};
+    if (F.approximate()) {
+        detail::writeULEB(Records, F.Bound);
+    }
+    uint64_t Last = 0;
+    for (size_t I = 0; I < F.Paths.size(); I++) {
+        detail::writeULEB(Records, F.Paths[I].first - Last);
+        detail::writeULEB(Records, F.Paths[I].second);
+        if (F.approximate()) {
+            detail::writeULEB(Records, F.Errors[I]);
+        }
+        if (F.timed()) {
+            detail::writeULEB(Records, F.Times[I].Total);
+            detail::writeULEB(Records, F.Times[I].Max);
+        }
+        Last = F.Paths[I].first;
+    }
+    E.Size = Records.size() - E.Offset;
+    return E;
+}
+
+/// Write the header and function table of a binary profile. The offsets
+/// in \p Table are relative to the records, which must follow.
+inline void writeBinaryHeader(FILE *Fp, std::vector<FunctionEntry> &Table,
+                              const ProfileInfo &Info) {
+    ProfileHeader H;
+    memcpy(H.Magic, ProfileMagic, sizeof(H.Magic));
+    H.Version             = ProfileVersion;
+    H.NumFunctions        = Table.size();
+    H.FunctionTableOffset = sizeof(ProfileHeader);
+    H.SampleBurst         = Info.Sampling.Burst;
+    H.SamplePeriod        = Info.Sampling.Period;
+    H.ModuleHash          = Info.ModuleHash;
+
+    uint64_t Base =
+        sizeof(ProfileHeader) + Table.size() * sizeof(FunctionEntry);
+    for (auto &E : Table) {
+        E.Offset += Base;
+    }
+    fwrite(&H, sizeof(H), 1, Fp);
+    fwrite(Table.data(), sizeof(FunctionEntry), Table.size(), Fp);
+}
+
+/// Write a profile in the binary format. \p Profile must be sorted by
+/// function id.
+inline void writeBinaryProfile(FILE *Fp, std::vector<FunctionProfile> &Profile,
+                               const ProfileInfo &Info = ProfileInfo()) {
+    std::vector<FunctionEntry> Table;
+    std::vector<uint8_t> Records;
+    for (auto &F : Profile) {
+        Table.push_back(encodeBinaryFunction(Records, F));
+    }
+    writeBinaryHeader(Fp, Table, Info);
+    fwrite(Records.data(), 1, Records.size(), Fp);
+}
+
+/// The time window of an epoch, in milliseconds since the Unix epoch.
+struct EpochInfo {
+    uint64_t Index;
+    uint64_t Start;
+    uint64_t End;
+};
+
+/// Append an epoch to an epochs file.
+inline void writeEpoch(FILE *Fp, const EpochInfo &E,
+                       std::vector<FunctionProfile> &Profile) {
+    fprintf(Fp, "# epoch %" PRIu64 " %" PRIu64 " %" PRIu64 "\n", E.Index,
+            E.Start, E.End);
+    for (auto &F : Profile) {
+        writeTextFunction(Fp, F);
+    }
+}
+
+/// Iterates over the paths of one function, decoding them directly from
+/// the mapped profile.
+class PathCursor {
+    const char *Pos = nullptr, *End = nullptr;
+    uint64_t Remaining = 0, Last = 0, Bound = 0;
+    bool Binary        = false;
+    bool Approximate   = false;
+    bool Timed         = false;
+    bool Dense         = false;
+
+    friend class ProfileReader;
+    friend class FunctionStream;
+
+  public:
+    uint64_t remaining() const { return Remaining; }
+
+    /// Whether the counts of this function are approximate, see
+    /// FunctionProfile.
+    bool approximate() const { return Approximate; }
+
+    /// The largest count of the paths of an approximate function which are
+    /// not listed, see FunctionProfile.
+    uint64_t bound() const { return Bound; }
+
+    /// Whether the paths of this function were timed, see FunctionProfile.
+    bool timed() const { return Timed; }
+
+    /// Decode the next path, returns false once all paths have been read
+    /// or if the profile is malformed.
+    bool next(uint64_t &Id, uint64_t &Count) {
+        uint64_t Error;
+        return next(Id, Count, Error);
+    }
+
+    /// Decode the next path along with the error bound of its count, which
+    /// is zero unless the function is approximate.
+    bool next(uint64_t &Id, uint64_t &Count, uint64_t &Error) {
+        PathTime Time;
+        return next(Id, Count, Error, Time);
+    }
+
+    /// Decode the next path along with the error bound of its count and the
+    /// cycles spent on it, which are zero unless the function is timed.
+    bool next(uint64_t &Id, uint64_t &Count, uint64_t &Error,
+              PathTime &Time) {
+        Error = 0;
+        Time  = PathTime();
+        if (Remaining == 0) {
+            return false;
+        }
+        Remaining--;
+        if (Dense) {
+            // Remaining only counts the executed paths, skip the others.
+            auto *P = reinterpret_cast<const uint64_t *>(Pos);
+            auto *E = reinterpret_cast<const uint64_t *>(End);
+            while (P < E && !*P) {
+                P++;
+            }
+            if (P == E) {
+                Remaining = 0;
+                return false;
+            }
+            Id    = P - reinterpret_cast<const uint64_t *>(Pos) + Last;
+            Count = *P;
+            Last  = Id + 1;
+            Pos   = reinterpret_cast<const char *>(P + 1);
+            return true;
+        }
+        if (Binary) {
+            auto *P = reinterpret_cast<const uint8_t *>(Pos);
+            auto *E = reinterpret_cast<const uint8_t *>(End);
+            uint64_t Delta;
+            if (!detail::readULEB(P, E, Delta) ||
+                !detail::readULEB(P, E, Count) ||
+                (Approximate && !detail::readULEB(P, E, Error)) ||
+                (Timed && (!detail::readULEB(P, E, Time.Total) ||
+                           !detail::readULEB(P, E, Time.Max)))) {
+                return false;
+            }
+            Pos = reinterpret_cast<const char *>(P);
+            Id = Last += Delta;
+            return true;
+        }
+        bool Ok = detail::readNumber(Pos, End, 16, Id) &&
+                  detail::readNumber(Pos, End, 10, Count) &&
+                  (!Approximate || detail::readNumber(Pos, End, 10, Error)) &&
+                  (!Timed || (detail::readNumber(Pos, End, 10, Time.Total) &&
+                              detail::readNumber(Pos, End, 10, Time.Max)));
+        detail::skipLine(Pos, End);
+        return Ok;
+    }
+};
+
+class FunctionStream;
+
+/// Reads a profile in either format. The file is mapped into memory and
+/// decoded in place.
+class ProfileReader {
+    const char *Data = nullptr;
+    size_t Size      = 0;
+    bool Binary      = false;
+    bool Mapped      = false;
+    ProfileInfo Info;
+    // Start of the first function of a text profile.
+    const char *Body = nullptr;
+
+    friend class FunctionStream;
+    friend class EpochReader;
+
+    /// Parse the metadata lines of a text profile.
+    bool readTextHeader() {
+        const char *Pos = Data, *End = Data + Size;
+        while (Pos < End && (*Pos == '#' || *Pos == '\n')) {
+            const char *Line = Pos;
+            detail::skipLine(Pos, End);
+            uint64_t V1, V2;
+            if (Pos - Line > 9 && !memcmp(Line, "# module ", 9)) {
+                Line += 9;
+                if (!detail::readNumber(Line, End, 16, V1)) {
+                    return false;
+                }
+                Info.ModuleHash = V1;
+            } else if (Pos - Line > 10 && !memcmp(Line, "# sampling", 10)) {
+                Line += 10;
+                if (!detail::readNumber(Line, End, 10, V1) ||
+                    !detail::readNumber(Line, End, 10, V2) || !V1) {
+                    return false;
+                }
+                Info.Sampling.Burst  = V1;
+                Info.Sampling.Period = V2;
+            }
+        }
+        Body = Pos;
+        return true;
+    }
+
+  public:
+    ProfileReader() = default;
+    ProfileReader(const ProfileReader &) = delete;
+    ProfileReader &operator=(const ProfileReader &) = delete;
+    ~ProfileReader() {
+        if (Mapped && Data) {
+            munmap(const_cast<char *>(Data), Size);
+        }
+    }
+
+    /// Map the profile, returns false if it can not be read.
+    bool open(const char *Path) {
+        int Fd = ::open(Path, O_RDONLY);
+        if (Fd < 0) {
+            return false;
+        }
+        struct stat St;
+        if (fstat(Fd, &St) != 0) {
+            close(Fd);
+            return false;
+        }
+        Size = St.st_size;
+        if (Size) {
+            void *P = mmap(nullptr, Size, PROT_READ, MAP_PRIVATE, Fd, 0);
+            if (P == MAP_FAILED) {
+                close(Fd);
+                return false;
+            }
+            Data = static_cast<const char *>(P);
+        }
+        close(Fd);
+        Mapped = true;
+        return parse();
+    }
+
+    /// Read a profile which is already in memory, it must outlive the
+    /// reader.
+    bool open(const char *Buffer, size_t Length) {
+        Data = Buffer;
+        Size = Length;
+        return parse();
+    }
+
+    bool isBinary() const { return Binary; }
+
+    const ProfileInfo &info() const { return Info; }
+    const SamplingInfo &sampling() const { return Info.Sampling; }
+
+    const ProfileHeader &header() const {
+        return *reinterpret_cast<const ProfileHeader *>(Data);
+    }
+
+    /// The function table of a binary profile.
+    const FunctionEntry *functions() const {
+        return reinterpret_cast<const FunctionEntry *>(
+            Data + header().FunctionTableOffset);
+    }
+
+    /// Find the paths of a function in a binary profile with a binary
+    /// search of the function table. Returns false if the function did
+    /// not execute.
+    bool lookup(uint32_t FunctionId, PathCursor &C) const {
+        auto *Begin = functions(), *End = Begin + header().NumFunctions;
+        auto *E     = std::lower_bound(Begin, End, FunctionId,
+                                   [](const FunctionEntry &E, uint32_t Id) {
+                                       return E.FunctionId < Id;
+                                   });
+        if (E == End || E->FunctionId != FunctionId) {
+            return false;
+        }
+        C = cursor(*E);
+        return true;
+    }
+
+    /// Call \p Fn(FunctionId, PathCursor &) for each function in the
+    /// profile, in the order they are stored. Returns false if the profile
+    /// is malformed.
+    template <typename Fn> bool forEachFunction(Fn F) const;
+
+  private:
+    bool parse() {
+        Binary = Size >= sizeof(ProfileMagic) &&
+                 memcmp(Data, ProfileMagic, sizeof(ProfileMagic)) == 0;
+        if (!Binary) {
+            return readTextHeader();
+        }
+        // The function table and the paths of each function must lie
+        // within the file. Sums are compared by subtraction so corrupt
+        // offsets can not overflow.
+        if (Size < sizeof(ProfileHeader) ||
+            header().Version != ProfileVersion) {
+            return false;
+        }
+        uint64_t TableOffset = header().FunctionTableOffset;
+        if (TableOffset < sizeof(ProfileHeader) || TableOffset > Size ||
+            header().NumFunctions >
+                (Size - TableOffset) / sizeof(FunctionEntry)) {
+            return false;
+        }
+        for (uint32_t I = 0; I < header().NumFunctions; I++) {
+            const FunctionEntry &E = functions()[I];
+            if (E.Offset > Size || E.Size > Size - E.Offset) {
+                return false;
+            }
+            // Dense counters are read as an array of 64 bit words, other
+            // path records take at least two bytes.
+            if ((E.Flags & DenseFunction) ? (E.Offset | E.Size) % sizeof(uint64_t) != 0
+                      : E.NumPaths > E.Size / 2) {
+                return false;
+            }
+            if (E.Flags & ApproximateFunction) {
+                auto *P = reinterpret_cast<const uint8_t *>(Data + E.Offset);
+                uint64_t Bound;
+                if (!detail::readULEB(P, P + E.Size, Bound)) {
+                    return false;
+                }
+            }
+        }
+        Info.Sampling.Burst  = header().SampleBurst;
+        Info.Sampling.Period = header().SamplePeriod;
+        Info.ModuleHash      = header().ModuleHash;
+        return true;
+    }
+
+    PathCursor cursor(const FunctionEntry &E) const {
+        PathCursor C;
+        C.Pos         = Data + E.Offset;
+        C.End         = C.Pos + E.Size;
+        C.Remaining   = E.NumPaths;
+        C.Binary      = true;
+        C.Approximate = E.Flags & ApproximateFunction;
+        C.Dense       = E.Flags & DenseFunction;
+        C.Timed       = E.Flags & TimedFunction;
+        if (C.Approximate) {
+            auto *P = reinterpret_cast<const uint8_t *>(C.Pos);
+            detail::readULEB(P, reinterpret_cast<const uint8_t *>(C.End),
+                             C.Bound);
+            C.Pos = reinterpret_cast<const char *>(P);
+        }
+        if (C.Dense) {
+            // The cursor reports the number of executed paths.
+            auto *P     = reinterpret_cast<const uint64_t *>(C.Pos);
+            auto *End   = reinterpret_cast<const uint64_t *>(C.End);
+            C.Remaining = End - P - std::count(P, End, 0);
+        }
+        return C;
+    }
+};
+
+/// Iterates over the functions of a profile in the order they are stored.
+/// A stream is a position in the profile which can be copied, to resume
+/// reading from the same function later.
+class FunctionStream {
+    const ProfileReader *Reader = nullptr;
+    // The next entry of the function table of a binary profile, or the
+    // next line of a text profile.
+    uint32_t Index  = 0;
+    const char *Pos = nullptr;
+    bool Malformed  = false;
+
+  public:
+    FunctionStream() = default;
+    explicit FunctionStream(const ProfileReader &R)
+        : Reader(&R), Pos(R.Body) {}
+
+    /// True if reading stopped at malformed data rather than at the end.
+    bool malformed() const { return Malformed; }
+
+    /// Read the next function, returns false at the end of the profile.
+    /// The paths are decoded from \p C.
+    bool next(uint32_t &FunctionId, PathCursor &C) {
+        const ProfileReader &R = *Reader;
+        if (R.Binary) {
+            if (Index == R.header().NumFunctions) {
+                return false;
+            }
+            const FunctionEntry &E = R.functions()[Index++];
+            if (E.Offset + E.Size > R.Size) {
+                Malformed = true;
+                return false;
+            }
+            FunctionId = E.FunctionId;
+            C          = R.cursor(E);
+            return true;
+        }
+
+        const char *End = R.Data + R.Size;
+        while (Pos < End && (*Pos == '\n' || *Pos == '#')) {
+            detail::skipLine(Pos, End);
+        }
+        if (Pos == End) {
+            return false;
+        }
+        uint64_t Id, NumPaths;
+        if (!detail::readNumber(Pos, End, 10, Id) ||
+            !detail::readNumber(Pos, End, 10, NumPaths)) {
+            Malformed = true;
+            return false;
+        }
+        // The header line may end with the "approximate" and "timed" flags.
+        C = PathCursor();
+        while (Pos < End && *Pos != '\n') {
+            if (*Pos == ' ') {
+                Pos++;
+            } else if (End - Pos >= 11 && !memcmp(Pos, "approximate", 11)) {
+                C.Approximate = true;
+                Pos += 11;
+                // Followed by the bound of the unlisted paths, if any.
+                const char *Bound = Pos;
+                if (!detail::readNumber(Bound, End, 10, C.Bound)) {
+                    C.Bound = 0;
+                } else {
+                    Pos = Bound;
+                }
+            } else if (End - Pos >= 5 && !memcmp(Pos, "timed", 5)) {
+                C.Timed = true;
+                Pos += 5;
+            } else {
+                break;
+            }
+        }
+        detail::skipLine(Pos, End);
+        C.Pos       = Pos;
+        C.End       = End;
+        C.Remaining = NumPaths;
+        FunctionId  = Id;
+
+        // Move past the path lines, the caller reads them from its cursor.
+        for (uint64_t I = 0; I < NumPaths; I++) {
+            detail::skipLine(Pos, End);
+        }
+        return true;
+    }
+
+    /// Move to the first function with an id of at least \p FunctionId,
+    /// functions must be stored in ascending id order.
+    void seek(uint32_t FunctionId) {
+        const ProfileReader &R = *Reader;
+        if (R.Binary) {
+            auto *Begin = R.functions(), *End = Begin + R.header().NumFunctions;
+            auto *E     = std::lower_bound(
+                Begin + Index, End, FunctionId,
+                [](const FunctionEntry &E, uint32_t Id) {
+                    return E.FunctionId < Id;
+                });
+            Index = E - Begin;
+            return;
+        }
+        uint32_t Id;
+        PathCursor C;
+        FunctionStream Next = *this;
+        while (Next.next(Id, C) && Id < FunctionId) {
+            *this = Next;
+        }
+    }
+};
+
+template <typename Fn> bool ProfileReader::forEachFunction(Fn F) const {
+    FunctionStream S(*this);
+    uint32_t FunctionId;
+    PathCursor C;
+    while (S.next(FunctionId, C)) {
+        F(FunctionId, C);
+    }
+    return !S.malformed();
+}
+
+/// Reads an epochs file, each epoch is read as a profile of its own.
+class EpochReader {
+    ProfileReader File;
+
+  public:
+    /// Map the file, returns false if it can not be read or does not hold
+    /// any epochs.
+    bool open(const char *Path) {
+        if (!File.open(Path) || File.isBinary()) {
+            return false;
+        }
+        // The first epoch follows the metadata lines.
+        for (const char *Pos = File.Data; Pos < File.Body;) {
+            if (File.Body - Pos > 8 && !memcmp(Pos, "# epoch ", 8)) {
+                return true;
+            }
+            detail::skipLine(Pos, File.Body);
+        }
+        return false;
+    }
+
+    const ProfileInfo &info() const { return File.info(); }
+
+    /// Call \p Fn(const EpochInfo &, const ProfileReader &) for each epoch
+    /// in order. Returns false if the file is malformed.
+    template <typename Fn> bool forEachEpoch(Fn F) const {
+        const char *Pos = File.Data, *End = File.Data + File.Size;
+        auto isEpoch    = [End](const char *Line) {
+            return End - Line > 8 && !memcmp(Line, "# epoch ", 8);
+        };
+        while (Pos < End) {
+            const char *Line = Pos;
+            detail::skipLine(Pos, End);
+            if (!isEpoch(Line)) {
+                continue;
+            }
+            EpochInfo Info;
+            Line += 8;
+            if (!detail::readNumber(Line, Pos, 10, Info.Index) ||
+                !detail::readNumber(Line, Pos, 10, Info.Start) ||
+                !detail::readNumber(Line, Pos, 10, Info.End)) {
+                return false;
+            }
+
+            // The epoch ends at the next epoch line.
+            const char *Begin = Pos;
+            while (Pos < End && !isEpoch(Pos)) {
+                detail::skipLine(Pos, End);
+            }
+            ProfileReader R;
+            if (!R.open(Begin, Pos - Begin)) {
+                return false;
+            }
+            F(Info, R);
+        }
+        return true;
+    }
+};
+
+/// Read a whole profile into memory. Returns false if it is malformed.
+inline bool readProfile(const ProfileReader &Reader,
+                        std::vector<FunctionProfile> &Profile) {
+    bool Ok    = true;
+    bool Valid = Reader.forEachFunction([&](uint32_t Id, PathCursor &C) {
+        // Dense functions are listed whether they executed or not. Once a
+        // function is found truncated the rest of the profile is skipped.
+        if (!Ok || !C.remaining()) {
+            return;
+        }
+        Profile.emplace_back(Id);
+        auto &F = Profile.back();
+        F.Bound = C.bound();
+        F.Paths.reserve(C.remaining());
+        uint64_t PathId, Count, Error;
+        PathTime Time;
+        while (C.remaining()) {
+            if (!C.next(PathId, Count, Error, Time)) {
+                Ok = false;
+                break;
+            }
+            F.Paths.emplace_back(PathId, Count);
+            if (C.approximate()) {
+                F.Errors.push_back(Error);
+            }
+            if (C.timed()) {
+                F.Times.push_back(Time);
+            }
+        }
+    });
+    return Ok && Valid;
+}
+
+} // namespace epp
+
+#endif
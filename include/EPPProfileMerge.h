@@ -0,0 +1,41 @@
+#ifndef EPPPROFILEMERGE_H
+#define EPPPROFILEMERGE_H
+
+#include "EPPProfileFormat.h"
+
+#include <string>
+#include <vector>
+
+namespace epp {
+
+/// A profile to merge, its counts are multiplied by Weight.
+struct MergeInput {
+    std::string Path;
+    double Weight;
+};
+
+struct MergeOptions {
+    ProfileFormat Format = TextProfile;
+    // Scale every input to the average total count of the inputs before
+    // applying its weight, so that long and short runs count the same.
+    bool Normalize = false;
+    // Number of merging threads, zero uses one per core.
+    unsigned Threads = 0;
+};
+
+/// Sum the path counts of several profiles of the same module into one
+/// profile written to \p Output. The inputs are merged function by
+/// function: ranges of function ids are merged in parallel, each with a
+/// k-way merge over the inputs, so only the paths of one function per
+/// thread are held in memory. Sampled inputs are scaled back to estimated
+/// counts. The cycles of timed paths are summed like the counts, keeping
+/// the longest execution of each path. Returns false with a description of
+/// the problem in \p Error if an input can not be read or the inputs come
+/// from different modules.
+bool mergeProfiles(const std::vector<MergeInput> &Inputs,
+                   const std::string &Output, const MergeOptions &Options,
+                   std::string &Error);
+
+} // namespace epp
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef EPPRUNTIME_H
+#define EPPRUNTIME_H
+
+/* Interface of the profiling runtime (epp-rt) for instrumented programs.
+ * This header is C compatible and installed along with the runtime. */
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Statistics about the runtime itself. Counts cover every thread which
+ * logged a path, including threads which have exited. */
+struct EPPStats {
+    uint64_t Threads;          /* Threads which logged a path. */
+    uint64_t LogCalls;         /* Paths counted, the sum of all counts. */
+    uint64_t SlowPathCalls;    /* Paths which missed the logging fast path. */
+    uint64_t TableResizes;     /* Path table grows and count promotions. */
+    uint64_t BytesAllocated;   /* Total bytes allocated for counters. */
+    uint64_t Functions;        /* Functions which executed a path. */
+    uint64_t DistinctPaths;    /* Executed paths, summed over functions. */
+    uint64_t MaxDistinctPaths; /* Paths of the function with the most. */
+    uint64_t MaxPathsFunction; /* Id of that function. */
+    uint64_t ProbedKeys;       /* Keys in the path tables of live threads, */
+    uint64_t ProbeTotal;       /* the slots inspected to find them all */
+    uint64_t ProbeMax;         /* and to find the farthest one. */
+    uint64_t Saves;            /* Completed saves and periodic dumps. */
+    uint64_t SaveNanos;        /* Time spent in them. */
+};
+
+/* Fill in the statistics of the runtime. This takes a snapshot of the
+ * profile, which costs about as much as a dump. */
+void __epp_getStats(struct EPPStats *Stats);
+
+/* Called by __epp_snapshot for each executed path. Error bounds the count
+ * of functions counted approximately (see -heavy-hitters) and is zero for
+ * the others. Returning non zero stops the snapshot. */
+typedef int (*EPPSnapshotCallback)(void *Context, uint32_t FunctionId,
+                                   uint64_t PathId, uint64_t Count,
+                                   uint64_t Error);
+
+/* Read the path counts of the whole program while it is running, without
+ * writing a profile. The counts of all threads, live or exited, are merged
+ * as for a dump: logging threads are never stopped or blocked. Functions
+ * are visited in ascending id order and the paths of a function by
+ * descending count. The callback runs after the snapshot is complete and
+ * may call back into the runtime. */
+void __epp_snapshot(EPPSnapshotCallback Callback, void *Context);
+
+/* Turn path profiling on or off in modules instrumented with -switchable,
+ * whose functions then run an uninstrumented copy of their body. Calls
+ * already in progress finish in the body they started in. Profiling starts
+ * off unless EPP_ENABLE=1 is set. */
+void __epp_enable(void);
+void __epp_disable(void);
+
+/* Close the current epoch and start the next one. The paths counted
+ * during the epoch are appended to <profile>.epochs, see
+ * EPP_EPOCH_INTERVAL. Logging threads are not blocked. */
+void __epp_advanceEpoch(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
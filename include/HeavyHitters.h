@@ -0,0 +1,273 @@
+#ifndef HEAVYHITTERS_H
+#define HEAVYHITTERS_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <unordered_map>
+#include <vector>
+
+namespace epp {
+
+/// A path whose count is only known approximately: it executed at least
+/// Count - Error and at most Count times.
+struct HeavyHitter {
+    uint64_t Path;
+    uint64_t Count;
+    uint64_t Error;
+};
+
+/// A heavy hitter summary which has been copied out of a SpaceSaving
+/// table, or merged from several. Paths which are not listed executed at
+/// most Bound times.
+struct HeavyHitterSummary {
+    std::vector<HeavyHitter> Paths;
+    uint64_t Bound = 0;
+
+    /// Merge \p Other into this summary and keep the \p Capacity paths with
+    /// the largest counts. A path missing from one of the summaries is
+    /// assumed to have executed up to that summary's bound, so the merged
+    /// counts and errors remain upper bounds and error bounds.
+    void merge(const HeavyHitterSummary &Other, uint32_t Capacity) {
+        std::unordered_map<uint64_t, const HeavyHitter *> Unmatched;
+        for (auto &H : Other.Paths) {
+            Unmatched[H.Path] = &H;
+        }
+        for (auto &H : Paths) {
+            auto It = Unmatched.find(H.Path);
+            if (It == Unmatched.end()) {
+                H.Count += Other.Bound;
+                H.Error += Other.Bound;
+            } else {
+                H.Count += It->second->Count;
+                H.Error += It->second->Error;
+                Unmatched.erase(It);
+            }
+        }
+        for (auto &H : Other.Paths) {
+            if (Unmatched.count(H.Path)) {
+                Paths.push_back({H.Path, H.Count + Bound, H.Error + Bound});
+            }
+        }
+
+        Bound += Other.Bound;
+        std::sort(Paths.begin(), Paths.end(),
+                  [](const HeavyHitter &H1, const HeavyHitter &H2) {
+                      return H1.Count > H2.Count ||
+                             (H1.Count == H2.Count && H1.Path > H2.Path);
+                  });
+        if (Paths.size() > Capacity) {
+            Bound = std::max(Bound, Paths[Capacity].Count);
+            Paths.resize(Capacity);
+        }
+    }
+};
+
+/// A Space-Saving summary (Metwally et al.) of the paths executed by one
+/// function, used in place of a PathTable for functions with too many
+/// executed paths to count exactly. It holds a fixed number of counters.
+/// When a new path arrives and all counters are in use, the path with the
+/// smallest count is replaced and the new path inherits its count, which
+/// becomes the error bound of the new path. Paths executed more often than
+/// total / Capacity times are always kept. The entries are also ordered in
+/// a binary min-heap on their counts, so finding the path to replace is
+/// constant time and each update costs O(log Capacity).
+///
+/// Like PathTable, a summary is only modified by its owning thread and may
+/// be copied by any thread with snapshot. Each update is guarded by a
+/// sequence lock, the storage is never reallocated.
+class SpaceSaving {
+    uint32_t Capacity;
+    uint32_t Size = 0;
+    uint32_t Seq  = 0;
+    uint64_t *Keys;
+    uint64_t *Counts;
+    uint64_t *Errors;
+    // Maps keys to their entry, -1 is an empty slot.
+    int32_t *Index;
+    uint32_t IndexMask;
+    // The entries as a min-heap on their counts, and the position of each
+    // entry in it. Only used by the owning thread.
+    uint32_t *Heap;
+    uint32_t *HeapPos;
+
+    uint32_t home(uint64_t Key) const {
+        return uint32_t((Key * 0x9E3779B97F4A7C15ULL) >> 32) & IndexMask;
+    }
+
+    /// The index slot of a key, or of the empty slot where it belongs.
+    uint32_t find(uint64_t Key) const {
+        uint32_t S = home(Key);
+        while (Index[S] >= 0 && Keys[Index[S]] != Key) {
+            S = (S + 1) & IndexMask;
+        }
+        return S;
+    }
+
+    /// Remove the key in slot \p S from the index, shifting back the keys
+    /// which follow it so that no probe sequence is broken.
+    void unindex(uint32_t S) {
+        uint32_t J = S;
+        while (true) {
+            J = (J + 1) & IndexMask;
+            if (Index[J] < 0) {
+                break;
+            }
+            uint32_t H = home(Keys[Index[J]]);
+            // Move the entry at J into the hole unless its home lies
+            // cyclically in (S, J].
+            bool InRange = S <= J ? (S < H && H <= J) : (S < H || H <= J);
+            if (!InRange) {
+                Index[S] = Index[J];
+                S        = J;
+            }
+        }
+        Index[S] = -1;
+    }
+
+    void place(uint32_t P, uint32_t E) {
+        Heap[P]    = E;
+        HeapPos[E] = P;
+    }
+
+    /// Restore the heap order after the count of the entry at heap
+    /// position \p P was set, it must not be smaller than its parent's.
+    void siftDown(uint32_t P) {
+        uint32_t E = Heap[P];
+        while (true) {
+            uint32_t C = 2 * P + 1;
+            if (C >= Size) {
+                break;
+            }
+            if (C + 1 < Size && Counts[Heap[C + 1]] < Counts[Heap[C]]) {
+                C++;
+            }
+            if (Counts[Heap[C]] >= Counts[E]) {
+                break;
+            }
+            place(P, Heap[C]);
+            P = C;
+        }
+        place(P, E);
+    }
+
+    /// Move the entry at heap position \p P up to its place.
+    void siftUp(uint32_t P) {
+        uint32_t E = Heap[P];
+        while (P > 0) {
+            uint32_t Parent = (P - 1) / 2;
+            if (Counts[Heap[Parent]] <= Counts[E]) {
+                break;
+            }
+            place(P, Heap[Parent]);
+            P = Parent;
+        }
+        place(P, E);
+    }
+
+    template <typename T> static void store(T *P, T V) {
+        __atomic_store_n(P, V, __ATOMIC_RELAXED);
+    }
+
+  public:
+    explicit SpaceSaving(uint32_t Capacity) : Capacity(Capacity) {
+        uint32_t IndexSize = 4;
+        while (IndexSize < Capacity * 2) {
+            IndexSize *= 2;
+        }
+        IndexMask = IndexSize - 1;
+        Keys      = static_cast<uint64_t *>(malloc(Capacity * 8));
+        Counts    = static_cast<uint64_t *>(malloc(Capacity * 8));
+        Errors    = static_cast<uint64_t *>(malloc(Capacity * 8));
+        Index     = static_cast<int32_t *>(malloc(IndexSize * 4));
+        Heap      = static_cast<uint32_t *>(malloc(Capacity * 4));
+        HeapPos   = static_cast<uint32_t *>(malloc(Capacity * 4));
+        if (!Keys || !Counts || !Errors || !Index || !Heap || !HeapPos) {
+            throw std::bad_alloc();
+        }
+        std::fill(Index, Index + IndexSize, -1);
+    }
+
+    SpaceSaving(const SpaceSaving &) = delete;
+    SpaceSaving &operator=(const SpaceSaving &) = delete;
+
+    ~SpaceSaving() {
+        free(Keys), free(Counts), free(Errors), free(Index);
+        free(Heap), free(HeapPos);
+    }
+
+    /// Bytes of storage held by the summary.
+    uint64_t bytes() const {
+        return Capacity * 3 * sizeof(uint64_t) +
+               Capacity * 2 * sizeof(uint32_t) +
+               (IndexMask + 1) * sizeof(int32_t);
+    }
+
+    /// Count one execution of a path.
+    void inc(uint64_t Key) {
+        __atomic_store_n(&Seq, Seq + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+
+        uint32_t S = find(Key);
+        if (Index[S] >= 0) {
+            store(&Counts[Index[S]], Counts[Index[S]] + 1);
+            siftDown(HeapPos[Index[S]]);
+        } else if (Size < Capacity) {
+            store(&Keys[Size], Key);
+            store(&Counts[Size], uint64_t(1));
+            store(&Errors[Size], uint64_t(0));
+            Index[S] = Size;
+            place(Size, Size);
+            siftUp(Size);
+            store(&Size, Size + 1);
+        } else {
+            uint32_t Min = Heap[0];
+            unindex(find(Keys[Min]));
+            store(&Keys[Min], Key);
+            store(&Errors[Min], Counts[Min]);
+            store(&Counts[Min], Counts[Min] + 1);
+            Index[find(Key)] = Min;
+            siftDown(0);
+        }
+
+        __atomic_store_n(&Seq, Seq + 1, __ATOMIC_RELEASE);
+    }
+
+    /// Copy the summary while the owning thread may still be updating it.
+    void snapshot(HeavyHitterSummary &Out) const {
+        while (true) {
+            uint32_t S1 = __atomic_load_n(&Seq, __ATOMIC_ACQUIRE);
+            if (S1 & 1) {
+                continue;
+            }
+            uint32_t N = __atomic_load_n(&Size, __ATOMIC_RELAXED);
+            Out.Paths.resize(N);
+            for (uint32_t I = 0; I < N; I++) {
+                Out.Paths[I] = {__atomic_load_n(&Keys[I], __ATOMIC_RELAXED),
+                                __atomic_load_n(&Counts[I], __ATOMIC_RELAXED),
+                                __atomic_load_n(&Errors[I], __ATOMIC_RELAXED)};
+            }
+            // Until every counter is in use no path has been evicted, so
+            // unlisted paths have never executed.
+            Out.Bound = 0;
+            if (N == Capacity && N) {
+                Out.Bound = std::min_element(Out.Paths.begin(),
+                                             Out.Paths.end(),
+                                             [](const HeavyHitter &H1,
+                                                const HeavyHitter &H2) {
+                                                 return H1.Count < H2.Count;
+                                             })
+                                ->Count;
+            }
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&Seq, __ATOMIC_RELAXED) == S1) {
+                return;
+            }
+        }
+    }
+};
+
+} // namespace epp
+
+#endif
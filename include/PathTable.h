@@ -0,0 +1,360 @@
+#ifndef PATHTABLE_H
+#define PATHTABLE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace epp {
+
+/// Storage discarded when a path table grows or promotes its counts is
+/// handed to this function. It defaults to free, the runtime replaces it
+/// to defer freeing while another thread may be taking a snapshot.
+using ReleaseFn = void (*)(void *);
+
+inline ReleaseFn &pathTableRelease() {
+    static ReleaseFn Release = free;
+    return Release;
+}
+
+/// Probe lengths of the keys found by PathTable::snapshot: the number of
+/// slots a lookup of each key inspects.
+struct ProbeStats {
+    uint64_t Keys  = 0;
+    uint64_t Total = 0;
+    uint64_t Max   = 0;
+};
+
+/// An open addressing hash table which maps path ids to execution counts.
+/// This is used by the runtime to record the paths executed by a function
+/// on a given thread. Keys and counts are stored inline in flat arrays and
+/// collisions are resolved by linear probing. The capacity is always a
+/// power of two and the table doubles when it is three quarters full.
+/// Counts start out as 32 bit values and the whole table is promoted to
+/// 64 bit counts the first time any count overflows.
+/// An empty slot is identified by a zero count, since every key present
+/// in the table has been seen at least once.
+///
+/// A table is only ever modified by its owning thread, but snapshot may
+/// be called from any thread at any time. Resizing is guarded by a
+/// sequence lock which the owner never waits on, counts are updated with
+/// relaxed atomic stores so that a reader sees each count whole.
+class PathTable {
+    uint64_t *Keys   = nullptr;
+    uint32_t *Narrow = nullptr;
+    uint64_t *Wide   = nullptr;
+    uint64_t Mask    = 0;
+    uint64_t Size    = 0;
+    uint32_t Shift   = 64;
+    uint32_t Seq     = 0;
+
+    static const uint64_t InitialCapacity = 16;
+
+    /// Fibonacci hashing, path ids are usually small and dense so the
+    /// multiplication spreads them across the high bits.
+    uint64_t slot(uint64_t Key) const {
+        return (Key * 0x9E3779B97F4A7C15ULL) >> Shift;
+    }
+
+    uint64_t count(uint64_t S) const { return Wide ? Wide[S] : Narrow[S]; }
+
+    template <typename T> static void store(T *P, T V) {
+        __atomic_store_n(P, V, __ATOMIC_RELAXED);
+    }
+
+    /// Mark the start and end of a resize for concurrent readers.
+    void beginResize() {
+        __atomic_store_n(&Seq, Seq + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+    }
+    void endResize() { __atomic_store_n(&Seq, Seq + 1, __ATOMIC_RELEASE); }
+
+    /// Allocate new storage. The mask is published last so that a reader
+    /// which sees the new mask also sees arrays which are large enough.
+    void allocate(uint64_t Capacity) {
+        auto *K = static_cast<uint64_t *>(malloc(Capacity * sizeof(uint64_t)));
+        if (!K) {
+            throw std::bad_alloc();
+        }
+        store(&Keys, K);
+        if (Wide) {
+            auto *W =
+                static_cast<uint64_t *>(calloc(Capacity, sizeof(uint64_t)));
+            if (!W) {
+                throw std::bad_alloc();
+            }
+            store(&Wide, W);
+        } else {
+            auto *N =
+                static_cast<uint32_t *>(calloc(Capacity, sizeof(uint32_t)));
+            if (!N) {
+                throw std::bad_alloc();
+            }
+            store(&Narrow, N);
+        }
+        __atomic_store_n(&Mask, Capacity - 1, __ATOMIC_RELEASE);
+        Shift = 64 - __builtin_ctzll(Capacity);
+    }
+
+    /// Find the slot for a key which is known not to be in the table.
+    uint64_t findEmpty(uint64_t Key) const {
+        uint64_t S = slot(Key);
+        while (count(S) != 0) {
+            S = (S + 1) & Mask;
+        }
+        return S;
+    }
+
+    void grow() {
+        uint64_t *OldKeys   = Keys;
+        uint32_t *OldNarrow = Narrow;
+        uint64_t *OldWide   = Wide;
+        uint64_t OldCap     = OldKeys ? Mask + 1 : 0;
+
+        beginResize();
+        allocate(OldCap ? OldCap * 2 : InitialCapacity);
+
+        for (uint64_t I = 0; I < OldCap; I++) {
+            uint64_t C = OldWide ? OldWide[I] : OldNarrow[I];
+            if (C) {
+                uint64_t S = findEmpty(OldKeys[I]);
+                store(&Keys[S], OldKeys[I]);
+                if (Wide) {
+                    store(&Wide[S], C);
+                } else {
+                    store(&Narrow[S], uint32_t(C));
+                }
+            }
+        }
+        endResize();
+
+        ReleaseFn Release = pathTableRelease();
+        if (OldKeys) {
+            Release(OldKeys);
+            Release(OldNarrow ? static_cast<void *>(OldNarrow) : OldWide);
+        }
+    }
+
+    /// Widen all the counts in the table to 64 bits.
+    void promote() {
+        uint64_t Capacity = Mask + 1;
+        auto *W =
+            static_cast<uint64_t *>(malloc(Capacity * sizeof(uint64_t)));
+        if (!W) {
+            throw std::bad_alloc();
+        }
+        beginResize();
+        for (uint64_t I = 0; I < Capacity; I++) {
+            W[I] = Narrow[I];
+        }
+        uint32_t *OldNarrow = Narrow;
+        __atomic_store_n(&Wide, W, __ATOMIC_RELEASE);
+        store(&Narrow, static_cast<uint32_t *>(nullptr));
+        endResize();
+        pathTableRelease()(OldNarrow);
+    }
+
+    /// Return the slot holding the key, inserting it with a zero count
+    /// if it is not present. A zero count is only transient, the callers
+    /// always add a non zero value immediately after.
+    uint64_t lookupOrInsert(uint64_t Key) {
+        if (Keys) {
+            uint64_t S = slot(Key);
+            while (count(S) != 0) {
+                if (Keys[S] == Key) {
+                    return S;
+                }
+                S = (S + 1) & Mask;
+            }
+            if ((Size + 1) * 4 <= (Mask + 1) * 3) {
+                store(&Keys[S], Key);
+                Size++;
+                return S;
+            }
+        }
+        grow();
+        uint64_t S = findEmpty(Key);
+        store(&Keys[S], Key);
+        Size++;
+        return S;
+    }
+
+    /// Set the count of a slot. Release ordering publishes the key of a
+    /// newly inserted slot along with its first count.
+    void setCount(uint64_t S, uint64_t C) {
+        if (Wide) {
+            __atomic_store_n(&Wide[S], C, __ATOMIC_RELEASE);
+        } else {
+            __atomic_store_n(&Narrow[S], uint32_t(C), __ATOMIC_RELEASE);
+        }
+    }
+
+  public:
+    PathTable() = default;
+    PathTable(const PathTable &) = delete;
+    PathTable &operator=(const PathTable &) = delete;
+
+    PathTable(PathTable &&Other) noexcept { *this = std::move(Other); }
+
+    PathTable &operator=(PathTable &&Other) noexcept {
+        if (this != &Other) {
+            clear();
+            Keys = Other.Keys, Narrow = Other.Narrow, Wide = Other.Wide;
+            Mask = Other.Mask, Size = Other.Size, Shift = Other.Shift;
+            Other.Keys = nullptr, Other.Narrow = nullptr, Other.Wide = nullptr;
+            Other.Mask = 0, Other.Size = 0, Other.Shift = 64;
+        }
+        return *this;
+    }
+
+    ~PathTable() { clear(); }
+
+    /// Increment the count of a path by one.
+    void inc(uint64_t Key) {
+        uint64_t S = lookupOrInsert(Key);
+        if (!Wide && Narrow[S] == UINT32_MAX) {
+            promote();
+        }
+        setCount(S, count(S) + 1);
+    }
+
+    /// Increment the count of a path which is already present in the table.
+    /// Returns false without modifying the table if the path has not been
+    /// seen before or if its count would need to be promoted, the caller
+    /// should then fall back to inc. This is the logging fast path.
+    bool tryInc(uint64_t Key) {
+        if (!Keys) {
+            return false;
+        }
+        uint64_t S = slot(Key);
+        while (Keys[S] != Key || count(S) == 0) {
+            if (count(S) == 0) {
+                return false;
+            }
+            S = (S + 1) & Mask;
+        }
+        if (Wide) {
+            store(&Wide[S], Wide[S] + 1);
+        } else if (Narrow[S] != UINT32_MAX) {
+            store(&Narrow[S], Narrow[S] + 1);
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    /// Add an arbitrary non zero count to a path, used when merging
+    /// tables from different threads.
+    void add(uint64_t Key, uint64_t Count) {
+        if (Count == 0) {
+            return;
+        }
+        uint64_t S = lookupOrInsert(Key);
+        if (!Wide && uint64_t(Narrow[S]) + Count > UINT32_MAX) {
+            promote();
+        }
+        setCount(S, count(S) + Count);
+    }
+
+    /// Visit every (path id, count) pair in the table in slot order. Only
+    /// the owning thread, or any thread once the owner has stopped
+    /// updating the table, may call this.
+    template <typename Fn> void forEach(Fn F) const {
+        if (!Keys) {
+            return;
+        }
+        for (uint64_t I = 0; I <= Mask; I++) {
+            if (uint64_t C = count(I)) {
+                F(Keys[I], C);
+            }
+        }
+    }
+
+    /// Append every (path id, count) pair to \p Out while the owning thread
+    /// may still be updating the table. The copy is retried if the table is
+    /// resized meanwhile. Storage released by a resize must stay readable
+    /// until the snapshot returns, see pathTableRelease. The probe lengths
+    /// of the keys are added to \p Probes if it is given.
+    void snapshot(std::vector<std::pair<uint64_t, uint64_t>> &Out,
+                  ProbeStats *Probes = nullptr) const {
+        size_t Start = Out.size();
+        while (true) {
+            ProbeStats P;
+            uint32_t S1 = __atomic_load_n(&Seq, __ATOMIC_ACQUIRE);
+            if (S1 & 1) {
+                continue;
+            }
+            // Load the mask first, arrays published before it are at least
+            // as large as it says.
+            uint64_t M  = __atomic_load_n(&Mask, __ATOMIC_ACQUIRE);
+            uint64_t *K = __atomic_load_n(&Keys, __ATOMIC_RELAXED);
+            uint64_t *W = __atomic_load_n(&Wide, __ATOMIC_ACQUIRE);
+            uint32_t *N = __atomic_load_n(&Narrow, __ATOMIC_RELAXED);
+            if (K && (W || N)) {
+                for (uint64_t I = 0; I <= M; I++) {
+                    uint64_t C = W ? __atomic_load_n(&W[I], __ATOMIC_ACQUIRE)
+                                   : __atomic_load_n(&N[I], __ATOMIC_ACQUIRE);
+                    if (!C) {
+                        continue;
+                    }
+                    uint64_t Key = __atomic_load_n(&K[I], __ATOMIC_RELAXED);
+                    Out.emplace_back(Key, C);
+                    if (Probes) {
+                        uint64_t Home = (Key * 0x9E3779B97F4A7C15ULL) >>
+                                        (64 - __builtin_ctzll(M + 1));
+                        uint64_t Length = ((I - Home) & M) + 1;
+                        P.Keys++;
+                        P.Total += Length;
+                        P.Max = std::max(P.Max, Length);
+                    }
+                }
+            }
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&Seq, __ATOMIC_RELAXED) == S1) {
+                if (Probes) {
+                    Probes->Keys += P.Keys;
+                    Probes->Total += P.Total;
+                    Probes->Max = std::max(Probes->Max, P.Max);
+                }
+                return;
+            }
+            Out.resize(Start);
+        }
+    }
+
+    uint64_t size() const { return Size; }
+    bool empty() const { return Size == 0; }
+
+    /// Bytes of storage currently held by the table.
+    uint64_t bytes() const {
+        uint64_t Count = Wide ? sizeof(uint64_t) : sizeof(uint32_t);
+        return Keys ? (Mask + 1) * (sizeof(uint64_t) + Count) : 0;
+    }
+
+    /// Release all storage held by the table.
+    void clear() {
+        free(Keys), free(Narrow), free(Wide);
+        Keys = nullptr, Narrow = nullptr, Wide = nullptr;
+        Mask = 0, Size = 0, Shift = 64;
+    }
+};
+
+/// The runtime keeps the path tables of a thread in a two level directory
+/// indexed by function id. A page of tables is only allocated when one of
+/// its functions first logs a path on the thread.
+const uint32_t PathTablePageBits = 8;
+const uint32_t PathTablePageSize = 1u << PathTablePageBits;
+const uint32_t PathTablePageMask = PathTablePageSize - 1;
+
+inline PathTable &lookupPathTable(PathTable *const *Directory,
+                                  uint64_t FunctionId) {
+    return Directory[FunctionId >> PathTablePageBits]
+                    [FunctionId & PathTablePageMask];
+}
+
+} // namespace epp
+
+#endif
@@ -0,0 +1,173 @@
+#ifndef PATHTIMES_H
+#define PATHTIMES_H
+
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+#include "EPPProfileFormat.h"
+#include "PathTable.h"
+
+namespace epp {
+
+/// The cycles spent on a path of a function, as copied out of a PathTimes
+/// table.
+struct TimedPath {
+    uint32_t FunctionId;
+    uint64_t Path;
+    PathTime Time;
+};
+
+/// An open addressing hash table which accumulates the cycles spent on the
+/// paths executed by one thread, for the functions instrumented with
+/// -timed-paths. Unlike PathTable there is a single table per thread keyed
+/// by function and path id, the counts of timed paths are kept in the path
+/// tables as usual.
+///
+/// A table is only ever modified by its owning thread, but snapshot may be
+/// called from any thread at any time. Like PathTable, resizing is guarded
+/// by a sequence lock which the owner never waits on and the fields are
+/// updated with relaxed atomic stores. The total and maximum of a path are
+/// read independently, so a snapshot may see one update of a path but not
+/// the other.
+class PathTimes {
+    struct Entry {
+        uint64_t Path;
+        uint32_t FunctionId;
+        uint32_t Used;
+        uint64_t Total;
+        uint64_t Max;
+    };
+
+    Entry *Entries = nullptr;
+    uint64_t Mask  = 0;
+    uint64_t Size  = 0;
+    uint32_t Seq   = 0;
+
+    static const uint64_t InitialCapacity = 64;
+
+    static uint64_t hash(uint32_t FunctionId, uint64_t Path) {
+        return (Path ^ (uint64_t(FunctionId) << 40)) * 0x9E3779B97F4A7C15ULL;
+    }
+
+    template <typename T> static void store(T *P, T V) {
+        __atomic_store_n(P, V, __ATOMIC_RELAXED);
+    }
+
+    /// Find the entry of a path, or the empty entry where it belongs.
+    Entry *find(uint32_t FunctionId, uint64_t Path) const {
+        uint64_t S = (hash(FunctionId, Path) >> 32) & Mask;
+        while (Entries[S].Used && (Entries[S].Path != Path ||
+                                   Entries[S].FunctionId != FunctionId)) {
+            S = (S + 1) & Mask;
+        }
+        return &Entries[S];
+    }
+
+    void grow() {
+        Entry *Old      = Entries;
+        uint64_t OldCap = Old ? Mask + 1 : 0;
+        uint64_t NewCap = OldCap ? OldCap * 2 : InitialCapacity;
+        auto *New = static_cast<Entry *>(calloc(NewCap, sizeof(Entry)));
+        if (!New) {
+            throw std::bad_alloc();
+        }
+
+        __atomic_store_n(&Seq, Seq + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        store(&Entries, New);
+        __atomic_store_n(&Mask, NewCap - 1, __ATOMIC_RELEASE);
+        for (uint64_t I = 0; I < OldCap; I++) {
+            if (Old[I].Used) {
+                Entry *E = find(Old[I].FunctionId, Old[I].Path);
+                store(&E->Path, Old[I].Path);
+                store(&E->FunctionId, Old[I].FunctionId);
+                store(&E->Total, Old[I].Total);
+                store(&E->Max, Old[I].Max);
+                store(&E->Used, 1u);
+            }
+        }
+        __atomic_store_n(&Seq, Seq + 1, __ATOMIC_RELEASE);
+
+        if (Old) {
+            pathTableRelease()(Old);
+        }
+    }
+
+  public:
+    PathTimes() = default;
+    PathTimes(const PathTimes &) = delete;
+    PathTimes &operator=(const PathTimes &) = delete;
+    ~PathTimes() { clear(); }
+
+    /// Add one execution of a path which took \p Cycles cycles.
+    void add(uint32_t FunctionId, uint64_t Path, uint64_t Cycles) {
+        add(FunctionId, Path, PathTime{Cycles, Cycles});
+    }
+
+    /// Add the executions of a path summarized by \p Time, used when
+    /// merging the tables of different threads.
+    void add(uint32_t FunctionId, uint64_t Path, const PathTime &Time) {
+        if (!Entries || (Size + 1) * 4 > (Mask + 1) * 3) {
+            grow();
+        }
+        Entry *E = find(FunctionId, Path);
+        if (!E->Used) {
+            store(&E->Path, Path);
+            store(&E->FunctionId, FunctionId);
+            __atomic_store_n(&E->Used, 1u, __ATOMIC_RELEASE);
+            Size++;
+        }
+        store(&E->Total, E->Total + Time.Total);
+        if (Time.Max > E->Max) {
+            store(&E->Max, Time.Max);
+        }
+    }
+
+    /// Append the time of every path to \p Out while the owning thread may
+    /// still be updating the table. The copy is retried if the table is
+    /// resized meanwhile, see PathTable::snapshot.
+    void snapshot(std::vector<TimedPath> &Out) const {
+        size_t Start = Out.size();
+        while (true) {
+            uint32_t S1 = __atomic_load_n(&Seq, __ATOMIC_ACQUIRE);
+            if (S1 & 1) {
+                continue;
+            }
+            uint64_t M = __atomic_load_n(&Mask, __ATOMIC_ACQUIRE);
+            Entry *T   = __atomic_load_n(&Entries, __ATOMIC_RELAXED);
+            for (uint64_t I = 0; T && I <= M; I++) {
+                if (!__atomic_load_n(&T[I].Used, __ATOMIC_ACQUIRE)) {
+                    continue;
+                }
+                TimedPath P;
+                P.FunctionId = __atomic_load_n(&T[I].FunctionId,
+                                               __ATOMIC_RELAXED);
+                P.Path       = __atomic_load_n(&T[I].Path, __ATOMIC_RELAXED);
+                P.Time.Total = __atomic_load_n(&T[I].Total, __ATOMIC_RELAXED);
+                P.Time.Max   = __atomic_load_n(&T[I].Max, __ATOMIC_RELAXED);
+                Out.push_back(P);
+            }
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&Seq, __ATOMIC_RELAXED) == S1) {
+                return;
+            }
+            Out.resize(Start);
+        }
+    }
+
+    /// Bytes of storage currently held by the table.
+    uint64_t bytes() const { return Entries ? (Mask + 1) * sizeof(Entry) : 0; }
+
+    /// Release all storage held by the table.
+    void clear() {
+        free(Entries);
+        Entries = nullptr;
+        Mask = 0, Size = 0;
+    }
+};
+
+} // namespace epp
+
+#endif
@@ -7,6 +7,7 @@
 #include "llvm/Analysis/CFG.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/raw_ostream.h"
+#include <algorithm>
 #include <set>
 #include <vector>
 
@@ -40,9 +41,10 @@ void AuxGraph::init(Function &F) {
     Nodes = postOrder(F);
     SmallVector<BasicBlock *, 4> Leaves;
     for (auto &BB : Nodes) {
-        if (BB->getTerminator()->getNumSuccessors() > 0) {
-            for (auto S = succ_begin(BB), E = succ_end(BB); S != E; S++) {
-                add(BB, *S);
+        auto *Term = BB->getTerminator();
+        if (Term->getNumSuccessors() > 0) {
+            for (unsigned I = 0, E = Term->getNumSuccessors(); I != E; I++) {
+                add(BB, Term->getSuccessor(I), true, I);
             }
         } else {
             Leaves.push_back(BB);
@@ -64,11 +66,12 @@ void AuxGraph::init(Function &F) {
 
 /// Add a new edge to the edge list. This method is only used for
 /// adding real edges by the constructor.
-EdgePtr AuxGraph::add(BasicBlock *src, BasicBlock *tgt, bool isReal) {
+EdgePtr AuxGraph::add(BasicBlock *src, BasicBlock *tgt, bool isReal,
+                      unsigned succNum) {
     if (EdgeList.count(src) == 0) {
         EdgeList.insert({src, SmallVector<EdgePtr, 4>()});
     }
-    auto E = make_shared<Edge>(src, tgt, isReal);
+    auto E = make_shared<Edge>(src, tgt, isReal, succNum);
     EdgeList[src].push_back(E);
     return E;
 }
@@ -104,14 +107,20 @@ void AuxGraph::segment(
         assert(EdgeList.count(Src) &&
                "Source basicblock not found in edge list.");
         auto &Edges = EdgeList[Src];
-        auto it     = find_if(Edges.begin(), Edges.end(),
-                          [&Tgt](EdgePtr &P) { return P->tgt == Tgt; });
+        // Critical edges are not split before encoding, so a switch may
+        // branch to the same block from several cases. Each case is an
+        // edge of its own and all of them are segmented.
+        auto it = stable_partition(
+            Edges.begin(), Edges.end(),
+            [&Tgt](const EdgePtr &P) { return P->tgt != Tgt; });
         assert(it != Edges.end() &&
                "Target basicblock not found in edge list.");
-        assert(SegmentMap.count(*it) == 0 &&
-               "An edge can only be segmented once.");
-        SegmentList.push_back(move(*it));
-        Edges.erase(it);
+        for (auto I = it; I != Edges.end(); I++) {
+            assert(SegmentMap.count(*I) == 0 &&
+                   "An edge can only be segmented once.");
+            SegmentList.push_back(move(*I));
+        }
+        Edges.erase(it, Edges.end());
     }
 
     /// Add two new edges for each edge in the SegmentList. Update the EdgeList.
@@ -152,6 +161,164 @@ APInt AuxGraph::getEdgeWeight(const EdgePtr &Ptr) const {
     return Weights.at(Ptr);
 }
 
+/// Move the increments of the path counter onto the chords of a maximum
+/// spanning tree of the graph, as in Ball and Larus's optimal event
+/// counting, then rebalance them around blocks. \p Freqs estimates how
+/// often each edge executes so that the hottest edges are left in the tree
+/// without an increment. The weights themselves are unchanged, paths keep
+/// their ids and are decoded as before: along any path from the entry to
+/// the exit the increments add up to the same value as the weights.
+void AuxGraph::placeIncrements(
+    const std::unordered_map<EdgePtr, uint64_t> &Freqs) {
+    Increments.clear();
+
+    // Visit the edges in a deterministic order, most frequent first.
+    SmallVector<EdgePtr, 32> Edges;
+    for (auto &N : Nodes) {
+        for (auto &E : succs(N)) {
+            Edges.push_back(E);
+        }
+    }
+    auto Freq = [&Freqs](const EdgePtr &E) -> uint64_t {
+        auto It = Freqs.find(E);
+        return It == Freqs.end() ? 0 : It->second;
+    };
+    stable_sort(Edges.begin(), Edges.end(),
+                [&Freq](const EdgePtr &A, const EdgePtr &B) {
+                    return Freq(A) > Freq(B);
+                });
+
+    // Kruskal's algorithm on the undirected graph. The exit is joined to the
+    // entry before any other edge, this edge has weight zero and is never
+    // instrumented.
+    auto *Entry = Nodes.back(), *Exit = Nodes.front();
+    DenseMap<BasicBlock *, BasicBlock *> Leader;
+    for (auto &N : Nodes) {
+        Leader[N] = N;
+    }
+    auto Find = [&Leader](BasicBlock *B) {
+        while (Leader[B] != B) {
+            Leader[B] = Leader[Leader[B]];
+            B         = Leader[B];
+        }
+        return B;
+    };
+    Leader[Find(Exit)] = Find(Entry);
+
+    DenseMap<BasicBlock *, SmallVector<EdgePtr, 4>> Tree;
+    for (auto &E : Edges) {
+        auto *S = Find(E->src), *T = Find(E->tgt);
+        if (S != T) {
+            Leader[S] = T;
+            Tree[E->src].push_back(E);
+            Tree[E->tgt].push_back(E);
+        }
+    }
+
+    // Give every node the sum of the weights along its path in the tree
+    // from the entry, tree edges walked backwards counting negatively.
+    DenseMap<BasicBlock *, APInt> Potential;
+    Potential.insert({Entry, APInt(64, 0, true)});
+    Potential.insert({Exit, APInt(64, 0, true)});
+    SmallVector<BasicBlock *, 32> Worklist = {Entry, Exit};
+    while (!Worklist.empty()) {
+        auto *B = Worklist.pop_back_val();
+        for (auto &E : Tree.lookup(B)) {
+            bool Forward = E->src == B;
+            auto *Next   = Forward ? E->tgt : E->src;
+            if (Potential.count(Next)) {
+                continue;
+            }
+            APInt P = Forward ? Potential[B] + Weights.at(E)
+                              : Potential[B] - Weights.at(E);
+            Potential.insert({Next, P});
+            Worklist.push_back(Next);
+        }
+    }
+
+    // Tree edges are left with a zero increment, chords make up for the
+    // weights of the tree edges on the cycle they close.
+    for (auto &E : Edges) {
+        Increments.insert(
+            {E, Potential[E->src] + Weights.at(E) - Potential[E->tgt]});
+    }
+
+    // Every path through a block other than the entry and the exit takes
+    // one edge into it and one edge out of it, so an increment shared by
+    // the edges into a block can be moved onto the edges out of it. This
+    // is done when it leaves fewer increments which are not expected to
+    // execute more often, the edges into a block then share more of their
+    // instrumentation.
+    DenseMap<BasicBlock *, SmallVector<EdgePtr, 4>> Preds;
+    for (auto &E : Edges) {
+        Preds[E->tgt].push_back(E);
+    }
+    for (auto &N : Nodes) {
+        if (N == Entry || N == Exit) {
+            continue;
+        }
+        auto &In = Preds[N];
+        auto Out = succs(N);
+
+        // The most common non zero increment of the edges into N.
+        APInt D(64, 0, true);
+        long Best = 0;
+        for (auto &E : In) {
+            APInt V = Increments[E];
+            long C  = count_if(In.begin(), In.end(), [&](const EdgePtr &O) {
+                return Increments[O] == V;
+            });
+            if (V != 0 && C > Best) {
+                Best = C, D = V;
+            }
+        }
+        if (!Best) {
+            continue;
+        }
+
+        unsigned Before = 0, After = 0;
+        uint64_t FreqBefore = 0, FreqAfter = 0;
+        auto Tally = [&](const EdgePtr &E, const APInt &Old, const APInt &New) {
+            if (Old != 0) {
+                Before++, FreqBefore += Freq(E);
+            }
+            if (New != 0) {
+                After++, FreqAfter += Freq(E);
+            }
+        };
+        for (auto &E : In) {
+            Tally(E, Increments[E], Increments[E] - D);
+        }
+        for (auto &E : Out) {
+            Tally(E, Increments[E], Increments[E] + D);
+        }
+        if (After < Before && FreqAfter <= FreqBefore) {
+            for (auto &E : In) {
+                Increments[E] -= D;
+            }
+            for (auto &E : Out) {
+                Increments[E] += D;
+            }
+        }
+    }
+}
+
+/// Get all non-zero increments for non-segmented edges, see
+/// placeIncrements.
+SmallVector<pair<EdgePtr, APInt>, 16> AuxGraph::getIncrements() const {
+    SmallVector<pair<EdgePtr, APInt>, 16> Result;
+    copy_if(Increments.begin(), Increments.end(), back_inserter(Result),
+            [](const pair<EdgePtr, APInt> &V) {
+                return V.first->real && V.second.ne(APInt(64, 0, true));
+            });
+    return Result;
+}
+
+/// Get the increment of the path counter for a specific edge.
+APInt AuxGraph::getIncrement(const EdgePtr &Ptr) const {
+    return Increments.at(Ptr);
+}
+
 /// Return the successors edges of a basicblock from the Auxiliary Graph.
 SmallVector<EdgePtr, 4> AuxGraph::succs(BasicBlock *B) const {
     return EdgeList.lookup(B);
@@ -204,4 +371,5 @@ void AuxGraph::dotW(raw_ostream &os = errs()) const {
 /// Clear all internal state; to be called by the releaseMemory function
 void AuxGraph::clear() {
     Nodes.clear(), EdgeList.clear(), SegmentMap.clear(), Weights.clear();
+    Increments.clear();
 }
@@ -31,13 +31,22 @@ bool EPPDecode::runOnModule(Module &M) { return false; }
 void EPPDecode::getPathInfo(uint32_t FunctionId, Path &Info) {
     auto &F     = *FunctionIdToPtr[FunctionId];
     auto &Enc   = getAnalysis<EPPEncode>(F);
-    auto R      = decode(F, Info.Id, Enc);
+    vector<EdgePtr> Edges;
+    auto R      = decode(F, Info.Id, Enc, &Edges);
     Info.Type   = R.first;
     Info.Blocks = R.second;
+
+    APInt Zero(64, 0, true);
+    Info.EdgeIncs = 0, Info.ChordIncs = 0;
+    for (auto &E : Edges) {
+        Info.EdgeIncs += Enc.AG.getEdgeWeight(E).ne(Zero);
+        Info.ChordIncs += Enc.AG.getIncrement(E).ne(Zero);
+    }
 }
 
 pair<PathType, vector<BasicBlock *>>
-EPPDecode::decode(Function &F, APInt pathID, EPPEncode &E) {
+EPPDecode::decode(Function &F, APInt pathID, EPPEncode &E,
+                  vector<EdgePtr> *Edges) {
     vector<BasicBlock *> Sequence;
     auto *Position = &F.getEntryBlock();
 
@@ -70,6 +79,10 @@ EPPDecode::decode(Function &F, APInt pathID, EPPEncode &E) {
         pathID -= Wt;
     }
 
+    if (Edges) {
+        *Edges = SelectedEdges;
+    }
+
     if (SelectedEdges.empty()) {
         return {RIRO, Sequence};
     }
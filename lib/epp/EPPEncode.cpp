@@ -53,13 +53,15 @@ void dumpDotGraph(StringRef Filename, const AuxGraph &AG) {
 } // namespace
 
 bool EPPEncode::runOnFunction(Function &F) {
-    LI = &getAnalysis<LoopInfoWrapperPass>().getLoopInfo();
+    LI  = &getAnalysis<LoopInfoWrapperPass>().getLoopInfo();
+    BFI = &getAnalysis<BlockFrequencyInfoWrapperPass>().getBFI();
+    BPI = &getAnalysis<BranchProbabilityInfoWrapperPass>().getBPI();
     encode(F);
     return false;
 }
 
 void EPPEncode::releaseMemory() {
-    LI = nullptr;
+    LI = nullptr, BFI = nullptr, BPI = nullptr;
     NumPaths.clear();
     AG.clear();
 }
@@ -146,6 +148,70 @@ void EPPEncode::encode(Function &F) {
     if (dumpGraphs) {
         dumpDotGraph("auxgraph-3.dot", AG);
     }
+
+    placeIncrements();
+}
+
+/// Place the increments of the path counter on the chords of a spanning tree
+/// of the AuxGraph, keeping the edges expected to execute most often in the
+/// tree. Frequencies are estimated statically from the block frequencies
+/// and branch probabilities of the original CFG. The dummy edges of a
+/// segmented edge execute as often as the edge itself, and the edge of a
+/// leaf to the fake exit as often as the leaf.
+void EPPEncode::placeIncrements() {
+    auto EdgeFreq = [this](const BasicBlock *Src, const BasicBlock *Tgt) {
+        return (BFI->getBlockFreq(Src) * BPI->getEdgeProbability(Src, Tgt))
+            .getFrequency();
+    };
+
+    std::unordered_map<EdgePtr, uint64_t> Freqs;
+    for (auto &B : AG.nodes()) {
+        for (auto &SE : AG.succs(B)) {
+            if (SE->real) {
+                Freqs[SE] = EdgeFreq(SE->src, SE->tgt);
+            } else if (B->getTerminator()->getNumSuccessors() == 0) {
+                Freqs[SE] = BFI->getBlockFreq(B).getFrequency();
+            }
+        }
+    }
+    for (auto &S : AG.getSegmentMap()) {
+        uint64_t Freq          = EdgeFreq(S.first->src, S.first->tgt);
+        Freqs[S.second.first]  = Freq;
+        Freqs[S.second.second] = Freq;
+    }
+
+    AG.placeIncrements(Freqs);
+}
+
+uint64_t epp::fnv1a(uint64_t Hash, StringRef Data) {
+    for (unsigned char C : Data) {
+        Hash = (Hash ^ C) * 0x100000001b3ULL;
+    }
+    return Hash;
+}
+
+/// Add the encoding of \p F, numbered \p FunctionId, to the hash \p Hash.
+/// Path ids are only meaningful for the encoding they were numbered with,
+/// which depends on the CFG the encoder saw. Profiles record a hash of the
+/// name, id, number of paths and edge weights of every function so that
+/// tools can tell whether they decode paths the same way.
+uint64_t EPPEncode::hash(uint64_t Hash, Function &F,
+                         uint32_t FunctionId) const {
+    APInt Paths = NumPaths.lookup(&F.getEntryBlock());
+    Hash        = fnv1a(Hash, F.getName());
+    Hash        = fnv1a(Hash, to_string(FunctionId));
+    Hash        = fnv1a(Hash, Paths.toString(10, false));
+    // Weights are incomplete when the number of paths overflowed.
+    if (Paths.eq(APInt(64, 0, true))) {
+        return Hash;
+    }
+    for (auto &B : AG.nodes()) {
+        for (auto &E : AG.succs(B)) {
+            Hash = fnv1a(Hash, AG.getEdgeWeight(E).toString(10, false));
+        }
+        Hash = fnv1a(Hash, ";");
+    }
+    return Hash;
 }
 
 char EPPEncode::ID = 0;
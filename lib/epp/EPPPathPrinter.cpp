@@ -7,19 +7,24 @@
 #include "llvm/IR/DebugInfo.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/Support/Debug.h"
+#include "llvm/Support/Format.h"
 #include "llvm/Support/raw_ostream.h"
 
-#include <fstream>
-#include <sstream>
-
 #include "EPPDecode.h"
 #include "EPPPathPrinter.h"
+#include "EPPProfileFormat.h"
+
+#include <functional>
+#include <numeric>
+#include <set>
 
 using namespace llvm;
 using namespace epp;
 using namespace std;
 
 extern cl::opt<string> profile;
+extern cl::opt<unsigned> epochTopPaths;
+extern cl::opt<unsigned> hotPaths;
 
 bool EPPPathPrinter::doInitialization(Module &M) {
     uint32_t Id = 0;
@@ -53,71 +58,300 @@ bool EPPPathPrinter::runOnModule(Module &M) {
 
     auto &D = getAnalysis<EPPDecode>();
 
-    ifstream InFile(profile.c_str(), ios::in);
-    assert(InFile.is_open() && "Could not open file for reading");
+    EpochReader Epochs;
+    if (Epochs.open(profile.c_str())) {
+        checkModuleHash(M, Epochs.info().ModuleHash);
+        printEpochs(D, Epochs);
+        return false;
+    }
+
+    ProfileReader Reader;
+    if (!Reader.open(profile.c_str())) {
+        report_fatal_error("Could not open profile '" + Twine(profile) + "'");
+    }
+    checkModuleHash(M, Reader.info().ModuleHash);
 
     errs() << "# Decoded Paths\n";
 
-    try {
-        string Line;
-        while (getline(InFile, Line)) {
-            uint64_t FunctionId = 0, NumberOfPaths = 0;
-            stringstream SS(Line);
-            SS >> FunctionId >> NumberOfPaths;
+    // The counts of a sampled profile are scaled back to estimates of the
+    // number of times each path executed.
+    const SamplingInfo &Sampling = Reader.sampling();
+    if (Sampling.sampled()) {
+        errs() << "# Sampled " << Sampling.Burst << " of every "
+               << Sampling.Period << " paths\n";
+    }
 
-            // If no paths have been executed for this function,
-            // then skip it altogether. A continue over here is fine,
-            // since there are no lines for the paths themselves and
-            // the next line we expect is for one FunctionId and NumberOfPaths.
+    // The paths of timed functions, ranked by cycles once all are read.
+    vector<pair<PathTime, pair<uint32_t, Path>>> Timed;
+    uint64_t TotalCycles = 0;
 
-            if (NumberOfPaths == 0)
-                continue;
+    // Increments of the path counter executed by the profiled run, see
+    // printIncrements.
+    uint64_t EdgeIncs = 0, ChordIncs = 0;
 
-            errs() << "- name: " << FunctionIdToPtr[FunctionId]->getName()
-                   << "\n";
-            errs() << "  num_exec_paths: " << NumberOfPaths << "\n";
-
-            vector<Path> Paths;
-            for (uint32_t I = 0; I < NumberOfPaths; I++) {
-                getline(InFile, Line);
-
-                stringstream SS(Line);
-                string PathIdStr;
-                uint64_t PathExecFreq;
-                SS >> PathIdStr >> PathExecFreq;
-                APInt PathId(64, StringRef(PathIdStr), 16);
-
-                // Add a path data struct for each path we find in the
-                // profile. For each struct only initialize the Id and
-                // Frequency fields.
-                Path P = {PathId, PathExecFreq};
-                D.getPathInfo(FunctionId, P);
-                Paths.push_back(P);
+    bool Valid = Reader.forEachFunction([&](uint32_t FunctionId,
+                                            PathCursor &C) {
+        // If no paths have been executed for this function,
+        // then skip it altogether.
+        uint64_t NumberOfPaths = C.remaining();
+        if (NumberOfPaths == 0)
+            return;
+
+        errs() << "- name: " << FunctionIdToPtr[FunctionId]->getName() << "\n";
+        errs() << "  num_exec_paths: " << NumberOfPaths << "\n";
+        if (C.approximate()) {
+            errs() << "  approximate: true\n";
+        }
+
+        vector<Path> Paths;
+        vector<PathTime> Times;
+        uint64_t PathId, PathExecFreq, PathError;
+        PathTime Time;
+        while (C.next(PathId, PathExecFreq, PathError, Time)) {
+            // Add a path data struct for each path we find in the
+            // profile. For each struct only initialize the Id,
+            // Frequency and Error fields.
+            Path P  = {APInt(64, PathId), PathExecFreq};
+            P.Error = PathError;
+            D.getPathInfo(FunctionId, P);
+            Paths.push_back(P);
+            Times.push_back(Time);
+            EdgeIncs += P.Freq * P.EdgeIncs;
+            ChordIncs += P.Freq * P.ChordIncs;
+            if (C.timed()) {
+                Timed.push_back({Time, {FunctionId, P}});
+                TotalCycles += Time.Total;
             }
+        }
+        if (Paths.size() != NumberOfPaths) {
+            report_fatal_error("Invalid profile format?");
+        }
 
-            // Sort the paths in descending order of their frequency
-            // If the frequency is same, descending order of id (id cannot be
-            // same)
-            sort(Paths.begin(), Paths.end(),
-                 [](const Path &P1, const Path &P2) {
-                     return (P1.Freq > P2.Freq) ||
-                            (P1.Freq == P2.Freq && P1.Id.uge(P2.Id));
-                 });
+        // Sort the paths in descending order of their frequency
+        // If the frequency is same, descending order of id (id cannot be
+        // same)
+        vector<size_t> Order(Paths.size());
+        iota(Order.begin(), Order.end(), 0);
+        sort(Order.begin(), Order.end(), [&Paths](size_t I1, size_t I2) {
+            const Path &P1 = Paths[I1], &P2 = Paths[I2];
+            return (P1.Freq > P2.Freq) ||
+                   (P1.Freq == P2.Freq && P1.Id.uge(P2.Id));
+        });
 
-            for (auto &P : Paths) {
-                SmallString<16> PathId;
-                P.Id.toStringSigned(PathId, 16);
-                errs() << "  - path: " << PathId << "\n";
-                printPathSrc(P.Blocks, errs(), std::string("      "));
+        for (size_t I : Order) {
+            auto &P = Paths[I];
+            SmallString<16> Id;
+            P.Id.toStringSigned(Id, 16);
+            errs() << "  - path: " << Id << "\n";
+            if (Sampling.sampled()) {
+                errs() << "    est_freq: "
+                       << uint64_t(P.Freq * Sampling.scale() + 0.5) << "\n";
+            }
+            // A heavy hitter summary only bounds the frequency: the path
+            // executed between freq - error and freq times.
+            if (C.approximate()) {
+                errs() << "    freq: " << P.Freq << "\n";
+                errs() << "    error: " << P.Error << "\n";
             }
+            if (C.timed()) {
+                errs() << "    cycles: " << Times[I].Total << "\n";
+                errs() << "    max_cycles: " << Times[I].Max << "\n";
+            }
+            printPathSrc(P.Blocks, errs(), std::string("      "));
         }
-    } catch (...) {
+    });
+
+    if (!Valid) {
         report_fatal_error("Invalid profile format?");
     }
 
-    InFile.close();
+    if (!Timed.empty()) {
+        printHotPaths(Timed, TotalCycles);
+    }
+
+    printIncrements(EdgeIncs, ChordIncs);
 
     return false;
 }
 
+/// Make sure the profile was recorded with the same encoding of the module
+/// as the one paths are decoded with, see EPPEncode::hash. Decoding only
+/// reruns the passes which shape the CFG before encoding, a profile of
+/// another build of the module or of a CFG transformed differently would
+/// otherwise be attributed to the wrong paths.
+void EPPPathPrinter::checkModuleHash(Module &M, uint64_t Recorded) {
+    // Profiles written without a hash can not be checked.
+    if (!Recorded) {
+        return;
+    }
+    uint64_t Hash = FNV1aOffset;
+    uint32_t Id   = 0;
+    for (auto &F : M) {
+        if (!F.isDeclaration()) {
+            Hash = getAnalysis<EPPEncode>(F).hash(Hash, F, Id);
+        }
+        Id++;
+    }
+    if (Hash != Recorded) {
+        report_fatal_error("Profile '" + Twine(profile) +
+                           "' was recorded for a different module");
+    }
+}
+
+/// Print how many increments of the path counter the profiled run executed
+/// with an increment on every edge of non-zero weight, how many with the
+/// increments on the chords of a spanning tree only (-event-counting) and
+/// the share saved by the latter. The counts are derived from the decoded
+/// paths so they hold whichever placement the program was built with.
+void EPPPathPrinter::printIncrements(uint64_t EdgeIncs, uint64_t ChordIncs) {
+    errs() << "# Dynamic Increments\n";
+    errs() << "  every_edge: " << EdgeIncs << "\n";
+    errs() << "  chords: " << ChordIncs << "\n";
+    errs() << "  saved: "
+           << format("%.2f", EdgeIncs ? 100.0 * (double(EdgeIncs) -
+                                                 double(ChordIncs)) /
+                                            EdgeIncs
+                                      : 0.0)
+           << "%\n";
+}
+
+/// Print the paths of timed functions which took the most cycles in total,
+/// across all functions, with their share of the cycles of all timed paths.
+void EPPPathPrinter::printHotPaths(
+    vector<pair<PathTime, pair<uint32_t, Path>>> &Timed,
+    uint64_t TotalCycles) {
+    // Descending total cycles, then ascending function id.
+    size_t Top = min<size_t>(hotPaths, Timed.size());
+    partial_sort(Timed.begin(), Timed.begin() + Top, Timed.end(),
+                 [](const pair<PathTime, pair<uint32_t, Path>> &T1,
+                    const pair<PathTime, pair<uint32_t, Path>> &T2) {
+                     return T1.first.Total > T2.first.Total ||
+                            (T1.first.Total == T2.first.Total &&
+                             T1.second.first < T2.second.first);
+                 });
+
+    errs() << "# Hot Paths\n";
+    for (size_t I = 0; I < Top; I++) {
+        const PathTime &T = Timed[I].first;
+        Path &P           = Timed[I].second.second;
+        SmallString<16> Id;
+        P.Id.toStringSigned(Id, 16);
+        errs() << "- name: "
+               << FunctionIdToPtr[Timed[I].second.first]->getName() << "\n";
+        errs() << "  path: " << Id << "\n";
+        errs() << "  cycles: " << T.Total << "\n";
+        errs() << "  share: "
+               << format("%.2f", TotalCycles ? 100.0 * T.Total / TotalCycles
+                                             : 0.0)
+               << "%\n";
+        errs() << "  freq: " << P.Freq << "\n";
+        errs() << "  mean_cycles: " << (P.Freq ? T.Total / P.Freq : 0)
+               << "\n";
+        errs() << "  max_cycles: " << T.Max << "\n";
+        printPathSrc(P.Blocks, errs(), std::string("    "));
+    }
+}
+
+namespace {
+
+/// A path of a function, (function id, path id).
+using PathKey = pair<uint32_t, uint64_t>;
+
+SmallString<16> pathIdString(uint64_t PathId) {
+    SmallString<16> Id;
+    APInt(64, PathId).toStringSigned(Id, 16);
+    return Id;
+}
+
+} // namespace
+
+/// Print a time series report of an epochs file: the most frequent paths
+/// of each epoch, then the frequency of each of those paths in every epoch.
+void EPPPathPrinter::printEpochs(EPPDecode &D, const EpochReader &Reader) {
+    errs() << "# Epochs\n";
+
+    const SamplingInfo &Sampling = Reader.info().Sampling;
+    if (Sampling.sampled()) {
+        errs() << "# Sampled " << Sampling.Burst << " of every "
+               << Sampling.Period << " paths\n";
+    }
+
+    // The top paths of any epoch.
+    set<PathKey> Series;
+    uint64_t NumEpochs = 0;
+
+    bool Valid = Reader.forEachEpoch([&](const EpochInfo &E,
+                                         const ProfileReader &R) {
+        vector<FunctionProfile> Profile;
+        if (!readProfile(R, Profile)) {
+            report_fatal_error("Invalid profile format?");
+        }
+        vector<pair<uint64_t, PathKey>> Paths;
+        uint64_t Total = 0;
+        for (auto &F : Profile) {
+            for (auto &P : F.Paths) {
+                Paths.push_back({P.second, {F.FunctionId, P.first}});
+                Total += P.second;
+            }
+        }
+        // Descending frequency, then descending function and path id.
+        size_t Top = min<size_t>(epochTopPaths, Paths.size());
+        partial_sort(Paths.begin(), Paths.begin() + Top, Paths.end(),
+                     greater<pair<uint64_t, PathKey>>());
+
+        errs() << "- epoch: " << E.Index << "\n";
+        errs() << "  start_ms: " << E.Start << "\n";
+        errs() << "  duration_ms: " << E.End - E.Start << "\n";
+        errs() << "  freq: " << Total << "\n";
+        errs() << "  top_paths:\n";
+        for (size_t I = 0; I < Top; I++) {
+            const PathKey &K = Paths[I].second;
+            errs() << "    - name: " << FunctionIdToPtr[K.first]->getName()
+                   << "\n";
+            errs() << "      path: " << pathIdString(K.second) << "\n";
+            errs() << "      freq: " << Paths[I].first << "\n";
+            Series.insert(K);
+        }
+        NumEpochs++;
+    });
+    if (!Valid) {
+        report_fatal_error("Invalid profile format?");
+    }
+
+    // A second pass collects the frequency of the top paths in every
+    // epoch, including those where they were not among the top paths.
+    map<PathKey, vector<uint64_t>> Freqs;
+    for (auto &K : Series) {
+        Freqs[K].assign(NumEpochs, 0);
+    }
+    uint64_t Epoch = 0;
+    Reader.forEachEpoch([&](const EpochInfo &E, const ProfileReader &R) {
+        R.forEachFunction([&](uint32_t FunctionId, PathCursor &C) {
+            uint64_t PathId, Count;
+            while (C.next(PathId, Count)) {
+                auto It = Freqs.find({FunctionId, PathId});
+                if (It != Freqs.end()) {
+                    It->second[Epoch] = Count;
+                }
+            }
+        });
+        Epoch++;
+    });
+
+    errs() << "# Path Time Series\n";
+    for (auto &F : Freqs) {
+        errs() << "- name: " << FunctionIdToPtr[F.first.first]->getName()
+               << "\n";
+        errs() << "  path: " << pathIdString(F.first.second) << "\n";
+        errs() << "  freq: [";
+        for (uint64_t I = 0; I < NumEpochs; I++) {
+            errs() << (I ? ", " : "") << F.second[I];
+        }
+        errs() << "]\n";
+        Path P = {APInt(64, F.first.second), 0};
+        D.getPathInfo(F.first.first, P);
+        printPathSrc(P.Blocks, errs(), std::string("    "));
+    }
+}
+
 char EPPPathPrinter::ID = 0;
@@ -1,7 +1,10 @@
 #define DEBUG_TYPE "epp_profile"
 #include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/STLExtras.h"
 #include "llvm/ADT/SmallVector.h"
 #include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/Triple.h"
 #include "llvm/Analysis/CFG.h"
 #include "llvm/Bitcode/BitcodeWriter.h"
 #include "llvm/IR/BasicBlock.h"
@@ -12,14 +15,19 @@
 #include "llvm/IR/InstrTypes.h"
 #include "llvm/IR/Instruction.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/IR/Intrinsics.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/FileSystem.h"
 #include "llvm/Support/GraphWriter.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Cloning.h"
 #include "llvm/Transforms/Utils/ModuleUtils.h"
+#include "llvm/Transforms/Utils/PromoteMemToReg.h"
 
 #include "EPPEncode.h"
 #include "EPPProfile.h"
+#include "EPPProfileFormat.h"
 
 #include <cassert>
 #include <tuple>
@@ -30,6 +38,22 @@ using namespace epp;
 using namespace std;
 
 extern cl::opt<string> profileOutputFilename;
+extern cl::opt<unsigned> arrayThreshold;
+extern cl::opt<CounterMode> counterMode;
+extern cl::list<string> atomicCounters;
+extern cl::list<string> shardedCounters;
+extern cl::opt<string> runtimeBitcode;
+extern cl::opt<bool> preserveMost;
+extern cl::opt<ProfileFormat> profileFormat;
+extern cl::opt<unsigned> samplePeriod;
+extern cl::opt<unsigned> sampleBurst;
+extern cl::list<string> heavyHitters;
+extern cl::opt<unsigned> heavyHitterPaths;
+extern cl::opt<unsigned> heavyHitterCapacity;
+extern cl::opt<bool> continuousCounters;
+extern cl::opt<bool> timedPaths;
+extern cl::opt<bool> switchable;
+extern cl::opt<bool> eventCounting;
 
 bool EPPProfile::doInitialization(Module &M) {
     uint32_t Id = 0;
@@ -44,8 +68,10 @@ bool EPPProfile::doFinalization(Module &M) { return false; }
 
 namespace {
 
-uint64_t NumInstInc = 0;
-uint64_t NumInstLog = 0;
+uint64_t NumInstInc      = 0;
+uint64_t NumInstLog      = 0;
+uint64_t NumMergedBlocks = 0;
+uint64_t NumMergedInsts  = 0;
 
 void saveModule(Module &m, StringRef filename) {
     error_code EC;
@@ -68,12 +94,21 @@ SmallVector<BasicBlock *, 1> getFunctionExitBlocks(Function &F) {
     return R;
 }
 
-void insertInc(BasicBlock *Block, const APInt &Inc, AllocaInst *Ctr) {
+/// Add \p Inc to the counter at the top of \p Block. When the counter is
+/// \p Known to be constant there it is simply set to the sum.
+void insertInc(BasicBlock *Block, const APInt &Inc, AllocaInst *Ctr,
+               const APInt *Known = nullptr) {
     if (Inc.ne(APInt(64, 0, true))) {
         //(errs() << "Inserting Increment " << Increment << " "
         //<< addPos->getParent()->getName() << "\n");
         auto *addPos = &*Block->getFirstInsertionPt();
-        auto *LI     = new LoadInst(Ctr, "ld.epp.ctr", addPos);
+        auto *CtrTy  = Ctr->getAllocatedType();
+        if (Known) {
+            new StoreInst(ConstantInt::get(CtrTy, *Known + Inc), Ctr, addPos);
+            ++NumInstInc;
+            return;
+        }
+        auto *LI = new LoadInst(Ctr, "ld.epp.ctr", addPos);
 
         Constant *CI =
             ConstantInt::getIntegerValue(Ctr->getAllocatedType(), Inc); //Inc is the edge weight
@@ -85,18 +120,43 @@ void insertInc(BasicBlock *Block, const APInt &Inc, AllocaInst *Ctr) {
     }
 }
 
-BasicBlock *interpose(BasicBlock *BB, BasicBlock *Succ,
-                      DominatorTree *DT = nullptr, LoopInfo *LI = nullptr) {
+/// Add the constant \p C to the path id \p V before \p Pos, folding it
+/// when \p V is a constant.
+Value *addToPath(Value *V, const APInt &C, const Twine &Name,
+                 Instruction *Pos) {
+    if (C == 0) {
+        return V;
+    }
+    if (auto *K = dyn_cast<ConstantInt>(V)) {
+        return ConstantInt::get(V->getType(), K->getValue() + C);
+    }
+    return BinaryOperator::CreateAdd(V, ConstantInt::get(V->getType(), C),
+                                     Name, Pos);
+}
 
-    unsigned SuccNum = GetSuccessorNumber(BB, Succ);
+BasicBlock *interpose(BasicBlock *BB, unsigned SuccNum) {
+    TerminatorInst *Term = BB->getTerminator();
+    BasicBlock *Succ     = Term->getSuccessor(SuccNum);
 
-    // If this is a critical edge, let SplitCriticalEdge do it. (This does
-    // not deal with critical edges which terminate at ehpads)
-    TerminatorInst *LatchTerm = BB->getTerminator();
-    if (SplitCriticalEdge(
-            LatchTerm, SuccNum,
-            CriticalEdgeSplittingOptions(DT, LI).setPreserveLCSSA())) {
-        return LatchTerm->getSuccessor(SuccNum);
+    // If this is a critical edge, give it a block of its own. The other
+    // edges from BB to Succ, eg. switch cases sharing a target, are
+    // instrumented separately so unlike SplitCriticalEdge they are left
+    // alone. (This does not deal with critical edges which terminate at
+    // ehpads)
+    if (isCriticalEdge(Term, SuccNum) && !Succ->isEHPad()) {
+        auto *New = BasicBlock::Create(BB->getContext(),
+                                       BB->getName() + "." + Succ->getName() +
+                                           "_crit_edge",
+                                       BB->getParent(), Succ);
+        BranchInst::Create(Succ, New);
+        Term->setSuccessor(SuccNum, New);
+
+        // Each edge from BB has an entry of its own in the phis of Succ,
+        // one of them now comes from the new block.
+        for (auto I = Succ->begin(); auto *PN = dyn_cast<PHINode>(&*I); ++I) {
+            PN->setIncomingBlock(PN->getBasicBlockIndex(BB), New);
+        }
+        return New;
     }
 
     // If the edge isn't critical, then BB has a single successor or Succ has a
@@ -106,7 +166,7 @@ BasicBlock *interpose(BasicBlock *BB, BasicBlock *Succ,
         auto *New = BasicBlock::Create(
             BB->getContext(), BB->getName() + ".intp", BB->getParent());
 
-        BB->getTerminator()->replaceUsesOfWith(Succ, New);
+        Term->setSuccessor(SuccNum, New);
         BranchInst::Create(Succ, New);
 
         // Hoist all special instructions from the Tgt block
@@ -126,36 +186,418 @@ BasicBlock *interpose(BasicBlock *BB, BasicBlock *Succ,
     // of the block.
     assert(BB->getTerminator()->getNumSuccessors() == 1 &&
            "Should have a single succ!");
-    return SplitBlock(BB, BB->getTerminator(), DT, LI);
+    return SplitBlock(BB, Term);
+}
+
+/// The value of the path counter on entry to each block of \p F where it is
+/// the same constant along every path reaching the block. The counter is
+/// zero at the function entry, restarts at the increment of the dummy entry
+/// edge after each segmented edge and real edges add their increment
+/// \p Inc to it.
+DenseMap<BasicBlock *, APInt>
+knownCounters(Function &F, const AuxGraph &AG,
+              function_ref<APInt(const EdgePtr &)> Inc) {
+    DenseMap<BasicBlock *, APInt> Known;
+    DenseSet<BasicBlock *> Varying;
+    SmallVector<BasicBlock *, 32> Worklist;
+
+    // Meet the counter on entry to B with the constant V, or with a value
+    // which is not constant when V is null.
+    auto Meet = [&](BasicBlock *B, const APInt *V) {
+        if (Varying.count(B)) {
+            return;
+        }
+        auto It = Known.find(B);
+        if (V && It == Known.end()) {
+            Known.insert({B, *V});
+        } else if (V && It->second == *V) {
+            return;
+        } else {
+            Known.erase(B);
+            Varying.insert(B);
+        }
+        Worklist.push_back(B);
+    };
+
+    APInt Zero(64, 0, true);
+    Meet(&F.getEntryBlock(), &Zero);
+    for (auto &S : AG.getSegmentMap()) {
+        APInt Post = Inc(S.second.second);
+        Meet(S.first->tgt, &Post);
+    }
+
+    while (!Worklist.empty()) {
+        auto *B    = Worklist.pop_back_val();
+        auto It    = Known.find(B);
+        bool Const = It != Known.end();
+        APInt V    = Const ? It->second : Zero;
+        for (auto &E : AG.succs(B)) {
+            if (E->real) {
+                APInt W = V + Inc(E);
+                Meet(E->tgt, Const ? &W : nullptr);
+            }
+        }
+    }
+    return Known;
+}
+
+/// Whether two interposed blocks do the same thing. They must branch to
+/// the same block, which receives the same values from both, and hold the
+/// same instructions up to the names of the values those define.
+bool isEquivalentBlock(BasicBlock *A, BasicBlock *B) {
+    auto *Succ = A->getSingleSuccessor();
+    if (!Succ || Succ != B->getSingleSuccessor() || A->size() != B->size() ||
+        isa<PHINode>(A->front()) || isa<PHINode>(B->front()) ||
+        A->isEHPad() || B->isEHPad()) {
+        return false;
+    }
+    for (auto I = Succ->begin(); auto *PN = dyn_cast<PHINode>(&*I); ++I) {
+        if (PN->getIncomingValueForBlock(A) !=
+            PN->getIncomingValueForBlock(B)) {
+            return false;
+        }
+    }
+
+    DenseMap<const Value *, const Value *> Renamed;
+    for (auto IA = A->begin(), IB = B->begin(); IA != A->end(); ++IA, ++IB) {
+        if (!IA->isSameOperationAs(&*IB)) {
+            return false;
+        }
+        for (unsigned Op = 0; Op < IA->getNumOperands(); Op++) {
+            const Value *VA = IA->getOperand(Op);
+            auto It         = Renamed.find(VA);
+            if ((It == Renamed.end() ? VA : It->second) != IB->getOperand(Op)) {
+                return false;
+            }
+        }
+        Renamed[&*IA] = &*IB;
+    }
+    return true;
+}
+
+/// Merge the equivalent blocks among the \p Interposed blocks holding
+/// instrumentation, see isEquivalentBlock. Edges into the same block often
+/// carry the same increment, or log the same path and restart the counter
+/// at the same value, and then share one block. The values defined in an
+/// interposed block are only used in it while the counter is in memory, so
+/// this runs before it is promoted.
+void coalesceBlocks(ArrayRef<BasicBlock *> Interposed) {
+    DenseMap<BasicBlock *, SmallVector<BasicBlock *, 4>> Kept;
+    for (auto *B : Interposed) {
+        auto *Succ = B->getSingleSuccessor();
+        if (!Succ) {
+            continue;
+        }
+        auto &Same = Kept[Succ];
+        auto It    = find_if(Same, [B](BasicBlock *K) {
+            return isEquivalentBlock(K, B);
+        });
+        if (It == Same.end()) {
+            Same.push_back(B);
+            continue;
+        }
+        for (auto I = Succ->begin(); auto *PN = dyn_cast<PHINode>(&*I); ++I) {
+            PN->removeIncomingValue(B, false);
+        }
+        NumMergedBlocks++;
+        NumMergedInsts += B->size();
+        B->replaceAllUsesWith(*It);
+        B->eraseFromParent();
+    }
+}
+
+GlobalVariable *getSampleCountdown(Module &M) {
+    if (auto *GV = M.getNamedGlobal("__epp_sampleCountdown")) {
+        return GV;
+    }
+    return new GlobalVariable(M, Type::getInt64Ty(M.getContext()), false,
+                              GlobalValue::ExternalLinkage, nullptr,
+                              "__epp_sampleCountdown", nullptr,
+                              GlobalValue::InitialExecTLSModel);
+}
+
+/// In sampling mode each log site decrements the thread's sample countdown
+/// and only calls the runtime when it reaches zero. The runtime logs the
+/// path and rearms the countdown for the rest of the burst or the next
+/// period, see EPP(logPathSampled). Returns the call.
+Instruction *insertSampledLogPath(Instruction *LogPos, Value *Path,
+                                  Value *FuncId) {
+    Module *M   = LogPos->getModule();
+    auto &Ctx   = M->getContext();
+    auto *CtrTy = Path->getType();
+    auto *CD    = getSampleCountdown(*M);
+
+    auto *Count = new LoadInst(CD, "ld.epp.sample", LogPos);
+    auto *Dec   = BinaryOperator::CreateSub(Count, ConstantInt::get(CtrTy, 1),
+                                          "epp.sample.dec", LogPos);
+    new StoreInst(Dec, CD, LogPos);
+    auto *Fire = new ICmpInst(LogPos, ICmpInst::ICMP_EQ, Dec,
+                              ConstantInt::get(CtrTy, 0), "epp.sample.fire");
+
+    // Burst out of every period executions call the runtime.
+    TerminatorInst *Then = SplitBlockAndInsertIfThen(
+        Fire, LogPos, false,
+        MDBuilder(Ctx).createBranchWeights(sampleBurst,
+                                           samplePeriod - sampleBurst));
+    auto *LogFun = cast<Function>(M->getOrInsertFunction(
+        "__epp_logPathSampled", Type::getVoidTy(Ctx), CtrTy, CtrTy));
+    return CallInst::Create(LogFun, {Path, FuncId}, "", Then);
+}
+
+/// The pointer to the block of continuous counters, see
+/// EPPProfile::allocateArrayCounter. It is initialized once the size of the
+/// block is known, in addCtorsAndDtors.
+GlobalVariable *getContinuousGlobal(Module &M) {
+    if (auto *GV = M.getNamedGlobal("__epp_continuous")) {
+        return GV;
+    }
+    auto *Ty = Type::getInt64PtrTy(M.getContext());
+    return new GlobalVariable(M, Ty, false, GlobalValue::InternalLinkage,
+                              ConstantPointerNull::get(Ty),
+                              "__epp_continuous");
+}
+
+/// Read the cycle counter, before \p Pos if it is given.
+Instruction *readCycles(Module *M, const Twine &Name,
+                        Instruction *Pos = nullptr) {
+    auto *ReadCycles =
+        Intrinsic::getDeclaration(M, Intrinsic::readcyclecounter);
+    return CallInst::Create(ReadCycles, Name, Pos);
+}
+
+/// The log sites of timed functions pass the cycles since the path started,
+/// read from \p Start, to the runtime. Returns the call.
+Instruction *insertTimedLogPath(Instruction *LogPos, Value *Path,
+                                Value *FuncId, AllocaInst *Start) {
+    Module *M     = LogPos->getModule();
+    auto *CtrTy   = Path->getType();
+    auto *Now     = readCycles(M, "epp.now", LogPos);
+    auto *Then    = new LoadInst(Start, "ld.epp.start", LogPos);
+    Value *Cycles =
+        BinaryOperator::CreateSub(Now, Then, "epp.cycles", LogPos);
+    auto *LogFun = cast<Function>(M->getOrInsertFunction(
+        "__epp_logPathTimed", Type::getVoidTy(M->getContext()), CtrTy, CtrTy,
+        CtrTy));
+    return CallInst::Create(LogFun, {Path, FuncId, Cycles}, "", LogPos);
 }
 
-void insertLogPath(BasicBlock *BB, uint64_t FuncId, AllocaInst *Ctr,
-                   Constant *Zap) {
+/// Log the path ending before \p logPos. The path id is the counter plus
+/// \p Pre, the increment of the last edge of the path, or \p Pre plus the
+/// \p Known value of the counter when it is constant there so that the
+/// counter need not be loaded. Unless the block returns the next path
+/// starts, the counter is set to \p Next, the increment of its first edge.
+void insertLogPath(Instruction *logPos, uint64_t FuncId, AllocaInst *Ctr,
+                   const APInt &Pre, const APInt *Known, Constant *Next,
+                   const ArrayCounter *AC, Value *Shard, AllocaInst *Start) {
 
-    // errs() << "Inserting Log: " << BB->getName() << "\n";
-    // errs() << *BB << "\n";
+    // errs() << "Inserting Log: " << logPos->getParent()->getName() << "\n";
+    // errs() << *logPos->getParent() << "\n";
 
-    Module *M    = BB->getModule();
+    Module *M    = logPos->getModule();
     auto &Ctx    = M->getContext();
     auto *voidTy = Type::getVoidTy(Ctx);
     auto *CtrTy  = Ctr->getAllocatedType();
-    auto *FIdArg = ConstantInt::getIntegerValue(CtrTy, APInt(64, FuncId, true));
-    auto *logFun = cast<Function>(
-        M->getOrInsertFunction("__epp_logPath", voidTy, CtrTy, CtrTy));
-
-    // We insert the logging function as the first thing in the basic block
-    // as we know for sure that there is no other instrumentation present in
-    // this basic block.
-    Instruction *logPos    = &*BB->getFirstInsertionPt();
-    auto *LI               = new LoadInst(Ctr, "ld.epp.ctr", logPos);
-    vector<Value *> Params = {LI, FIdArg};
-    auto *CI               = CallInst::Create(logFun, Params, "");
-    CI->insertAfter(LI);
-    (new StoreInst(Zap, Ctr))->insertAfter(CI);
+    bool Returns =
+        logPos->getParent()->getTerminator()->getNumSuccessors() == 0;
+
+    Value *Path = nullptr;
+    if (Known) {
+        Path = ConstantInt::get(CtrTy, *Known);
+    } else {
+        Path = new LoadInst(Ctr, "ld.epp.ctr", logPos);
+    }
+    Path              = addToPath(Path, Pre, "epp.path", logPos);
+    Instruction *Last = nullptr;
+
+    if (AC) {
+        // Array mode, the path id indexes directly into a per function
+        // counter array so the runtime does not need to be called.
+        Value *Slot = nullptr;
+        if (AC->Mode == Sharded || AC->Continuous) {
+            // The runtime moves the continuous block at startup and in
+            // forked children, so its address is loaded at each log site.
+            Value *Base = Shard;
+            if (AC->Continuous) {
+                Base = new LoadInst(getContinuousGlobal(*M), "ld.epp.block",
+                                    logPos);
+            }
+            Value *Idx = addToPath(Path, APInt(64, AC->Offset),
+                                   "epp.cnt.idx", logPos);
+            Slot = GetElementPtrInst::CreateInBounds(CtrTy, Base, Idx,
+                                                     "epp.cnt.ptr", logPos);
+        } else {
+            Value *Idx[] = {ConstantInt::get(CtrTy, 0), Path};
+            Slot         = GetElementPtrInst::CreateInBounds(
+                AC->Counters->getValueType(), AC->Counters, Idx,
+                "epp.cnt.ptr", logPos);
+        }
+
+        auto *One = ConstantInt::get(CtrTy, 1);
+        if (AC->Mode == Atomic) {
+            Last = new AtomicRMWInst(AtomicRMWInst::Add, Slot, One,
+                                     AtomicOrdering::Monotonic,
+                                     SyncScope::System, logPos);
+        } else {
+            auto *Count = new LoadInst(Slot, "ld.epp.cnt", logPos);
+            auto *Inc =
+                BinaryOperator::CreateAdd(Count, One, "epp.cnt.inc", logPos);
+            Last = new StoreInst(Inc, Slot, logPos);
+        }
+    } else if (samplePeriod) {
+        auto *FIdArg =
+            ConstantInt::getIntegerValue(CtrTy, APInt(64, FuncId, true));
+        insertSampledLogPath(logPos, Path, FIdArg);
+        // The counter is reset whether the path was sampled or not.
+        if (!Returns) {
+            new StoreInst(Next, Ctr, logPos);
+        }
+        ++NumInstLog;
+        return;
+    } else if (Start) {
+        auto *FIdArg =
+            ConstantInt::getIntegerValue(CtrTy, APInt(64, FuncId, true));
+        Last = insertTimedLogPath(logPos, Path, FIdArg, Start);
+    } else {
+        auto *FIdArg =
+            ConstantInt::getIntegerValue(CtrTy, APInt(64, FuncId, true));
+        // When the runtime fast path is linked in as bitcode call it
+        // instead, it is inlined after instrumentation, see linkRuntime.
+        // Otherwise the preserve_most entry point saves the caller from
+        // spilling its live registers around each out of line call.
+        StringRef LogName    = "__epp_logPath";
+        bool UsePreserveMost = false;
+        if (!runtimeBitcode.empty()) {
+            LogName = "__epp_logPathInline";
+        } else if (preserveMost &&
+                   Triple(M->getTargetTriple()).getArch() == Triple::x86_64) {
+            LogName         = "__epp_logPathPreserveMost";
+            UsePreserveMost = true;
+        }
+        auto *logFun = cast<Function>(
+            M->getOrInsertFunction(LogName, voidTy, CtrTy, CtrTy));
+        vector<Value *> Params = {Path, FIdArg};
+        auto *CI               = CallInst::Create(logFun, Params, "", logPos);
+        if (UsePreserveMost) {
+            logFun->setCallingConv(CallingConv::PreserveMost);
+            CI->setCallingConv(CallingConv::PreserveMost);
+        }
+        Last = CI;
+    }
+    // The counter is dead once the function returns.
+    if (Returns) {
+        ++NumInstLog;
+        return;
+    }
+    auto *Reset = new StoreInst(Next, Ctr);
+    Reset->insertAfter(Last);
+
+    // The next path of a timed function starts once the runtime returns.
+    if (Start) {
+        auto *Restart = readCycles(M, "epp.restart");
+        Restart->insertAfter(Reset);
+        (new StoreInst(Restart, Start))->insertAfter(Restart);
+    }
 
     ++NumInstLog;
 }
 
+/// The flag which turns the profiling of -switchable functions on, it is
+/// defined by the runtime, see EPP(enable).
+GlobalVariable *getEnabledGlobal(Module &M) {
+    if (auto *GV = M.getNamedGlobal("__epp_enabled")) {
+        return GV;
+    }
+    return new GlobalVariable(M, Type::getInt8Ty(M.getContext()), false,
+                              GlobalValue::ExternalLinkage, nullptr,
+                              "__epp_enabled");
+}
+
+/// Copy \p F before it is instrumented, for -switchable.
+Function *cloneUninstrumented(Function &F) {
+    ValueToValueMapTy VMap;
+    Function *Clean = CloneFunction(&F, VMap);
+    Clean->setName(F.getName() + ".epp.clean");
+    Clean->setLinkage(GlobalValue::InternalLinkage);
+    Clean->setComdat(nullptr);
+    return Clean;
+}
+
+/// Make the instrumented function \p F run \p Clean, its uninstrumented
+/// copy, while profiling is disabled. A new entry block checks the flag of
+/// the runtime and tail calls the copy when it is clear, so a disabled
+/// function costs a load and a branch. The static allocas of the old entry
+/// block are moved to the new one.
+void insertEntrySwitch(Function &F, Function *Clean) {
+    Module *M        = F.getParent();
+    auto &Ctx        = M->getContext();
+    BasicBlock *Body = &F.getEntryBlock();
+    auto *Entry      = BasicBlock::Create(Ctx, "epp.switch", &F, Body);
+    auto *Off        = BasicBlock::Create(Ctx, "epp.off", &F, Body);
+
+    for (auto It = Body->begin(); It != Body->end();) {
+        auto *AI = dyn_cast<AllocaInst>(&*It++);
+        if (AI && isa<Constant>(AI->getArraySize())) {
+            AI->moveBefore(*Entry, Entry->end());
+        }
+    }
+
+    // Other threads may flip the flag at any time.
+    auto *Flag = new LoadInst(getEnabledGlobal(*M), "ld.epp.enabled", Entry);
+    Flag->setAtomic(AtomicOrdering::Monotonic);
+    Flag->setAlignment(1);
+    auto *On = new ICmpInst(*Entry, ICmpInst::ICMP_NE, Flag,
+                            ConstantInt::get(Flag->getType(), 0), "epp.on");
+    BranchInst::Create(Body, Off, On, Entry);
+
+    SmallVector<Value *, 8> Args;
+    for (auto &A : F.args()) {
+        Args.push_back(&A);
+    }
+    auto *Call = CallInst::Create(Clean, Args, "", Off);
+    Call->setAttributes(Clean->getAttributes());
+    Call->setCallingConv(Clean->getCallingConv());
+    Call->setTailCall();
+    if (F.getReturnType()->isVoidTy()) {
+        ReturnInst::Create(Ctx, Off);
+    } else {
+        ReturnInst::Create(Ctx, Call, Off);
+    }
+}
+
+/// Insert the load of this thread's counter shard after \p Pos. The first
+/// time a thread reaches a sharded function the shard is null, so call into
+/// the runtime to allocate it. All the uses of \p Shard are rewritten to
+/// use the initialized shard.
+void insertShardInit(Instruction *Shard, Instruction *Pos) {
+    Module *M     = Pos->getModule();
+    auto *ShardTy = cast<PointerType>(Shard->getType());
+
+    SmallVector<Instruction *, 8> Users;
+    for (auto *U : Shard->users()) {
+        Users.push_back(cast<Instruction>(U));
+    }
+
+    Shard->insertAfter(Pos);
+    auto *IsNull = new ICmpInst(ICmpInst::ICMP_EQ, Shard,
+                                ConstantPointerNull::get(ShardTy));
+    IsNull->insertAfter(Shard);
+
+    Instruction *SplitPt = IsNull->getNextNode();
+    TerminatorInst *Then = SplitBlockAndInsertIfThen(IsNull, SplitPt, false);
+    auto *InitFun        = cast<Function>(
+        M->getOrInsertFunction("__epp_shardInit", ShardTy));
+    auto *Init = CallInst::Create(InitFun, "epp.shard.init", Then);
+
+    auto *Phi = PHINode::Create(ShardTy, 2, "epp.shard",
+                                &SplitPt->getParent()->front());
+    Phi->addIncoming(Shard, Shard->getParent());
+    Phi->addIncoming(Init, Init->getParent());
+
+    for (auto *U : Users) {
+        U->replaceUsesOfWith(Shard, Phi);
+    }
+}
+
 } // namespace
 
 void EPPProfile::addCtorsAndDtors(Module &Mod) {
@@ -165,8 +607,8 @@ void EPPProfile::addCtorsAndDtors(Module &Mod) {
     auto *int8PtrTy            = Type::getInt8PtrTy(Ctx, 0);
     uint32_t NumberOfFunctions = FunctionIds.size();
 
-    auto *EPPInit =
-        cast<Function>(Mod.getOrInsertFunction("__epp_init", voidTy, int32Ty));
+    auto *EPPInit = cast<Function>(Mod.getOrInsertFunction(
+        "__epp_init", voidTy, int32Ty, int32Ty, int8PtrTy));
     auto *EPPSave = cast<Function>(
         Mod.getOrInsertFunction("__epp_save", voidTy, int8PtrTy));
 
@@ -175,7 +617,98 @@ void EPPProfile::addCtorsAndDtors(Module &Mod) {
         cast<Function>(Mod.getOrInsertFunction("__epp_ctor", voidTy));
     auto *CtorBB = BasicBlock::Create(Ctx, "entry", EPPInitCtor);
     auto *Arg    = ConstantInt::get(int32Ty, NumberOfFunctions, false);
-    CallInst::Create(EPPInit, {Arg}, "", CtorBB);
+    auto *Format = ConstantInt::get(int32Ty, profileFormat, false);
+    IRBuilder<> CtorBuilder(CtorBB);
+    auto *Path =
+        CtorBuilder.CreateGlobalStringPtr(profileOutputFilename.getValue());
+    CallInst::Create(EPPInit, {Arg, Format, Path}, "", CtorBB);
+
+    if (samplePeriod) {
+        auto *EPPSampling = cast<Function>(Mod.getOrInsertFunction(
+            "__epp_setSampling", voidTy, int32Ty, int32Ty));
+        CallInst::Create(EPPSampling,
+                         {ConstantInt::get(int32Ty, sampleBurst, false),
+                          ConstantInt::get(int32Ty, samplePeriod, false)},
+                         "", CtorBB);
+    }
+
+    // Tell the runtime where the counters for array mode functions live
+    // so that they can be written out along with the hashed paths.
+    auto *int64Ty          = Type::getInt64Ty(Ctx);
+    auto *EPPRegisterArray = cast<Function>(
+        Mod.getOrInsertFunction("__epp_registerArray", voidTy, int32Ty,
+                                int64Ty->getPointerTo(), int64Ty));
+    auto *EPPRegisterSharded = cast<Function>(
+        Mod.getOrInsertFunction("__epp_registerShardedArray", voidTy, int32Ty,
+                                int64Ty, int64Ty));
+    auto *Zero            = ConstantInt::get(int64Ty, 0);
+    ArrayType *BlockTy    = nullptr;
+    GlobalVariable *Block = nullptr;
+    if (ContinuousWords) {
+        BlockTy = ArrayType::get(int64Ty, ContinuousWords);
+        Block   = new GlobalVariable(Mod, BlockTy, false,
+                                   GlobalValue::InternalLinkage,
+                                   ConstantAggregateZero::get(BlockTy),
+                                   "__epp_continuous.block");
+        Block->setAlignment(64);
+        getContinuousGlobal(Mod)->setInitializer(
+            ConstantExpr::getInBoundsGetElementPtr(
+                BlockTy, Block, ArrayRef<Constant *>({Zero, Zero})));
+    }
+    for (auto &AC : ArrayCounters) {
+        if (AC.Mode == Sharded) {
+            CallInst::Create(EPPRegisterSharded,
+                             {ConstantInt::get(int32Ty, AC.FunctionId, false),
+                              ConstantInt::get(int64Ty, AC.Offset, false),
+                              ConstantInt::get(int64Ty, AC.NumPaths, false)},
+                             "", CtorBB);
+            continue;
+        }
+        Constant *Base = nullptr;
+        if (AC.Continuous) {
+            Base = ConstantExpr::getInBoundsGetElementPtr(
+                BlockTy, Block,
+                ArrayRef<Constant *>(
+                    {Zero, ConstantInt::get(int64Ty, AC.Offset)}));
+        } else {
+            Base = ConstantExpr::getInBoundsGetElementPtr(
+                AC.Counters->getValueType(), AC.Counters,
+                ArrayRef<Constant *>({Zero, Zero}));
+        }
+        CallInst::Create(EPPRegisterArray,
+                         {ConstantInt::get(int32Ty, AC.FunctionId, false), Base,
+                          ConstantInt::get(int64Ty, AC.NumPaths, false)},
+                         "", CtorBB);
+    }
+
+    auto *EPPRegisterHeavyHitter = cast<Function>(Mod.getOrInsertFunction(
+        "__epp_registerHeavyHitter", voidTy, int32Ty, int32Ty));
+    auto *Capacity = ConstantInt::get(int32Ty, heavyHitterCapacity, false);
+    for (auto FunctionId : HeavyHitters) {
+        CallInst::Create(EPPRegisterHeavyHitter,
+                         {ConstantInt::get(int32Ty, FunctionId, false),
+                          Capacity},
+                         "", CtorBB);
+    }
+
+    auto *EPPModuleHash = cast<Function>(Mod.getOrInsertFunction(
+        "__epp_setModuleHash", voidTy, int64Ty));
+    CallInst::Create(EPPModuleHash,
+                     {ConstantInt::get(int64Ty, ModuleHash, false)}, "",
+                     CtorBB);
+
+    // Mapping the continuous counters comes last, once the runtime knows
+    // every function they hold.
+    if (Block) {
+        auto *Continuous = getContinuousGlobal(Mod);
+        auto *EPPRegisterContinuous = cast<Function>(
+            Mod.getOrInsertFunction("__epp_registerContinuous", voidTy,
+                                    Continuous->getType(), int64Ty));
+        CallInst::Create(EPPRegisterContinuous,
+                         {Continuous,
+                          ConstantInt::get(int64Ty, ContinuousWords, false)},
+                         "", CtorBB);
+    }
     ReturnInst::Create(Ctx, CtorBB);
     appendToGlobalCtors(Mod, EPPInitCtor, 0);
 
@@ -184,6 +717,11 @@ void EPPProfile::addCtorsAndDtors(Module &Mod) {
                        GlobalValue::ExternalLinkage, Number,
                        "__epp_numberOfFunctions");
 
+    auto *Words = ConstantInt::get(int64Ty, ShardWords, false);
+    new GlobalVariable(Mod, Words->getType(), false,
+                       GlobalValue::ExternalLinkage, Words,
+                       "__epp_shardWords");
+
     // Add global destructor to dump out results
     auto *EPPSaveDtor =
         cast<Function>(Mod.getOrInsertFunction("__epp_dtor", voidTy));
@@ -202,7 +740,8 @@ bool EPPProfile::runOnModule(Module &Mod) {
     errs() << "# Instrumented Functions\n";
 
     for (auto &F : Mod) {
-        if (F.isDeclaration())
+        // The uninstrumented copies made for -switchable have no id.
+        if (F.isDeclaration() || !FunctionIds.count(&F))
             continue;
 
         auto &Enc     = getAnalysis<EPPEncode>(F);
@@ -210,12 +749,50 @@ bool EPPProfile::runOnModule(Module &Mod) {
 
         errs() << "- name: " << F.getName() << "\n";
         errs() << "  num_paths: " << NumPaths << "\n";
+
+        // Path ids are only meaningful for the encoding they were numbered
+        // with, profiles record a hash of it so that tools can tell them
+        // apart, see EPPEncode::hash.
+        ModuleHash = Enc.hash(ModuleHash, F, FunctionIds[&F]);
         // Check if integer overflow occurred during path enumeration,
         // if it did then the entry block numpaths is set to zero.
         if (NumPaths.ne(APInt(64, 0, true))) {
-            instrument(F, Enc);
+            const ArrayCounter *AC = nullptr;
+            if (is_contained(heavyHitters, F.getName()) ||
+                (heavyHitterPaths && NumPaths.uge(heavyHitterPaths))) {
+                // Logged like any other function, the runtime counts its
+                // paths approximately.
+                HeavyHitters.push_back(FunctionIds[&F]);
+                errs() << "  counters: heavy-hitters\n";
+            } else if (NumPaths.ult(arrayThreshold) && !samplePeriod &&
+                       !timedPaths) {
+                // Sampling and timing apply to the runtime's path tables
+                // only, so every function is counted there when either is
+                // enabled.
+                AC = &allocateArrayCounter(F, NumPaths.getZExtValue());
+                errs() << "  counters: array\n";
+            }
+            // Heavy hitter functions are counted in bounded space, which
+            // timing every path would defeat.
+            bool Timed = timedPaths && !is_contained(HeavyHitters,
+                                                     FunctionIds[&F]);
+            if (Timed) {
+                errs() << "  timed: true\n";
+            }
+            // Variadic functions can not forward their arguments to a copy.
+            Function *Clean = nullptr;
+            if (switchable && !F.isVarArg()) {
+                Clean = cloneUninstrumented(F);
+                errs() << "  switchable: true\n";
+            }
+            instrument(F, Enc, AC, Timed);
+            if (Clean) {
+                insertEntrySwitch(F, Clean);
+            }
             errs() << "  num_inst_inc: " << NumInstInc << "\n";
             errs() << "  num_inst_log: " << NumInstLog << "\n";
+            errs() << "  num_merged_blocks: " << NumMergedBlocks << "\n";
+            errs() << "  num_merged_insts: " << NumMergedInsts << "\n";
         }
     }
 
@@ -224,9 +801,69 @@ bool EPPProfile::runOnModule(Module &Mod) {
     return true;
 }
 
+namespace {
+
+CounterMode getCounterMode(Function &F) {
+    if (is_contained(atomicCounters, F.getName())) {
+        return Atomic;
+    }
+    if (is_contained(shardedCounters, F.getName())) {
+        return Sharded;
+    }
+    return counterMode;
+}
+
+GlobalVariable *getShardGlobal(Module &M) {
+    if (auto *GV = M.getNamedGlobal("__epp_shard")) {
+        return GV;
+    }
+    return new GlobalVariable(M, Type::getInt64PtrTy(M.getContext()), false,
+                              GlobalValue::ExternalLinkage, nullptr,
+                              "__epp_shard", nullptr,
+                              GlobalValue::InitialExecTLSModel);
+}
+
+} // namespace
+
+/// Allocate a zero initialized array with one counter per path of the
+/// function. Functions with a small number of paths are counted directly
+/// in this array at each log site instead of calling into the runtime.
+/// Sharded functions are instead assigned a cache line aligned range of
+/// the per thread shard, and with -continuous-counters the other functions
+/// a range of the continuous block.
+const ArrayCounter &EPPProfile::allocateArrayCounter(Function &F,
+                                                     uint64_t NumPaths) {
+    CounterMode Mode = getCounterMode(F);
+    if (Mode == Sharded) {
+        ArrayCounters.push_back(
+            {FunctionIds[&F], nullptr, NumPaths, Mode, ShardWords, false});
+        ShardWords += alignTo(NumPaths, 8);
+        return ArrayCounters.back();
+    }
+    if (continuousCounters) {
+        ArrayCounters.push_back(
+            {FunctionIds[&F], nullptr, NumPaths, Mode, ContinuousWords, true});
+        ContinuousWords += alignTo(NumPaths, 8);
+        return ArrayCounters.back();
+    }
+
+    Module *M   = F.getParent();
+    auto *ArrTy = ArrayType::get(Type::getInt64Ty(M->getContext()), NumPaths);
+    auto *GV    = new GlobalVariable(*M, ArrTy, false,
+                                  GlobalValue::InternalLinkage,
+                                  ConstantAggregateZero::get(ArrTy),
+                                  "__epp_counters." + F.getName());
+    // Keep shared counters of different functions on separate cache lines.
+    GV->setAlignment(64);
+    ArrayCounters.push_back({FunctionIds[&F], GV, NumPaths, Mode, 0, false});
+    return ArrayCounters.back();
+}
+
 /// This routine inserts two types of instrumentation.
 /// 1. Incrementing a counter along a set of edges
-/// 2. Logging the value of the counter at certain blocks.
+/// 2. Logging the value of the counter at certain blocks, either by
+/// calling the runtime or by incrementing the counter for the path if the
+/// function is counted in array mode, see \p AC.
 /// For 1) The counter is incremented by splitting an existing
 /// edge in the CFG. This implies a new basic block is inserted
 /// between two basic blocks and the instrumentation is inserted
@@ -234,6 +871,12 @@ bool EPPProfile::runOnModule(Module &Mod) {
 /// For 2) The counter value is saved by the runtim at certain
 /// basic blocks. This is performed by the insertion of function
 /// call to the logging runtime function.
+/// The increments on either side of a log site are folded into it, the
+/// logged id and the restarted counter are constants added to or stored
+/// in place of the counter, and the counter is not loaded where its value
+/// is known, see knownCounters.
+/// If \p Timed the cycle counter is also read when the counter is reset and
+/// at each log site, and the runtime accumulates the cycles of each path.
 /// Goals:
 /// 1) Splitting edges should insert *new* blocks inside them so
 /// that the Graph structure which maintains the edge weights does
@@ -243,8 +886,10 @@ bool EPPProfile::runOnModule(Module &Mod) {
 ///   - splitting edges
 ///   - leaf log function calls
 ///   - counter allocation
-void EPPProfile::instrument(Function &F, EPPEncode &Enc) {
-    NumInstInc = 0, NumInstLog = 0;
+///   - promotion of the counter to SSA form
+void EPPProfile::instrument(Function &F, EPPEncode &Enc,
+                            const ArrayCounter *AC, bool Timed) {
+    NumInstInc = 0, NumInstLog = 0, NumMergedBlocks = 0, NumMergedInsts = 0;
 
     Module *M            = F.getParent();
     auto &Ctx            = M->getContext();
@@ -260,21 +905,51 @@ void EPPProfile::instrument(Function &F, EPPEncode &Enc) {
     auto *Ctr =
         new AllocaInst(CtrTy, DL.getAllocaAddrSpace(), nullptr, "epp.ctr");
 
+    // The cycle counter when the current path started, for timed paths.
+    AllocaInst *Start = nullptr;
+    if (Timed) {
+        Start = new AllocaInst(CtrTy, DL.getAllocaAddrSpace(), nullptr,
+                               "epp.start");
+    }
+
+    // Sharded counters are addressed relative to the thread's shard which
+    // is loaded once at function entry, see insertShardInit.
+    Instruction *Shard = nullptr;
+    if (AC && AC->Mode == Sharded) {
+        Shard = new LoadInst(getShardGlobal(*M), "ld.epp.shard");
+    }
+
     auto ExitBlocks = getFunctionExitBlocks(F);
 
-    // Get all the non-zero real edges to instrument
-    const auto &Wts = Enc.AG.getWeights();
+    // Get all the non-zero real edges to instrument. With event counting
+    // only the chords of the spanning tree built by EPPEncode have one.
+    auto Inc = [&Enc](const EdgePtr &E) {
+        return eventCounting ? Enc.AG.getIncrement(E)
+                             : Enc.AG.getEdgeWeight(E);
+    };
+    const auto &Wts =
+        eventCounting ? Enc.AG.getIncrements() : Enc.AG.getWeights();
 
     // Enc.AG.printWeights();
 
+    // Where the counter is known to be constant increments become stores
+    // and log sites need not load it.
+    auto Known   = knownCounters(F, Enc.AG, Inc);
+    auto KnownAt = [&Known](BasicBlock *B) -> const APInt * {
+        auto It = Known.find(B);
+        return It == Known.end() ? nullptr : &It->second;
+    };
+
+    SmallVector<BasicBlock *, 16> Interposed;
     for (auto &W : Wts) {
         auto &Ptr       = W.first;
         BasicBlock *Src = Ptr->src, *Tgt = Ptr->tgt;
         /*insert a basic block between Src and Tgt; 
         the instered block is used to insert "add" instruction*/
-        BasicBlock *N = interpose(Src, Tgt);
+        BasicBlock *N = interpose(Src, Ptr->succNum);
+        Interposed.push_back(N);
         // insert an instruction to add the edge weights
-        insertInc(N, W.second, Ctr);
+        insertInc(N, W.second, Ctr, KnownAt(Src));
     }
 
     // Get the weights for the segmented edges
@@ -287,22 +962,40 @@ void EPPProfile::instrument(Function &F, EPPEncode &Enc) {
         BasicBlock *Src = Ptr->src, *Tgt = Ptr->tgt;
 
         auto &AExit  = S.second.first;
-        APInt Pre    = Enc.AG.getEdgeWeight(AExit);
+        APInt Pre    = Inc(AExit);
         auto &EntryB = S.second.second;
-        APInt Post   = Enc.AG.getEdgeWeight(EntryB);
+        APInt Post   = Inc(EntryB);
 
-        BasicBlock *N = interpose(Src, Tgt);
+        // A block ending in an unconditional branch, such as a loop latch,
+        // logs before its branch instead of in a new block. The counter
+        // does not change in between and the whole block still belongs to
+        // the path which ends there.
+        Instruction *LogPos = Src->getTerminator();
+        if (LogPos->getNumSuccessors() != 1) {
+            BasicBlock *N = interpose(Src, Ptr->succNum);
+            Interposed.push_back(N);
+            LogPos = &*N->getFirstInsertionPt();
+        }
 
-        // Since we always add instrumentation
-        insertInc(N, Post, Ctr);
-        insertLogPath(N, FuncId, Ctr, Zap);
-        insertInc(N, Pre, Ctr);
+        // The increment of the last edge of the path is added to the path
+        // id as it is logged, the next path starts at the increment of its
+        // first edge.
+        insertLogPath(LogPos, FuncId, Ctr, Pre, KnownAt(Src),
+                      ConstantInt::get(CtrTy, Post), AC, Shard, Start);
     }
 
     // Add the logpath function for all function exiting
-    // basic blocks.
+    // basic blocks. The edge to the fake exit has weight zero but may
+    // carry an increment, which is added to the path id.
     for (auto &EB : ExitBlocks) {
-        insertLogPath(EB, FuncId, Ctr, Zap);
+        APInt Pre(64, 0, true);
+        for (auto &E : Enc.AG.succs(EB)) {
+            Pre = Inc(E);
+        }
+        // Nothing else is instrumented in an exit block, the path is logged
+        // at its top.
+        insertLogPath(&*EB->getFirstInsertionPt(), FuncId, Ctr, Pre,
+                      KnownAt(EB), Zap, AC, Shard, Start);
     }
 
     // Add the counter as the first instruction in the entry
@@ -310,6 +1003,31 @@ void EPPProfile::instrument(Function &F, EPPEncode &Enc) {
     Ctr->insertBefore(&*F.getEntryBlock().getFirstInsertionPt());
     auto *SI = new StoreInst(Zap, Ctr);
     SI->insertAfter(Ctr);
+
+    // The first path starts on entry.
+    if (Start) {
+        Start->insertAfter(SI);
+        auto *Now = readCycles(M, "epp.entry");
+        Now->insertAfter(Start);
+        (new StoreInst(Now, Start))->insertAfter(Now);
+    }
+
+    if (Shard) {
+        insertShardInit(Shard, SI);
+    }
+
+    coalesceBlocks(Interposed);
+
+    // The counter, and the start of the path of a timed function, are kept
+    // in memory while instrumenting and promoted to SSA values once every
+    // load and store is in place. The path register then stays in registers
+    // even when the instrumented module is compiled without optimization.
+    SmallVector<AllocaInst *, 2> Allocas = {Ctr};
+    if (Start) {
+        Allocas.push_back(Start);
+    }
+    DominatorTree DT(F);
+    PromoteMemToReg(Allocas, DT);
 }
 
 char EPPProfile::ID = 0;
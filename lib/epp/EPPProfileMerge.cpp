@@ -0,0 +1,334 @@
+#include "EPPProfileMerge.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cmath>
+#include <functional>
+#include <queue>
+#include <thread>
+
+using namespace epp;
+using namespace std;
+
+namespace {
+
+/// An input profile and what the first pass learned about it.
+struct Input {
+    ProfileReader Reader;
+    string Error;
+    // Sum of the counts and largest function id.
+    uint64_t Total = 0;
+    uint32_t MaxId = 0;
+    // The counts are multiplied by this when merged.
+    double Scale = 1.0;
+    // Position of the first function of each range of ids.
+    vector<FunctionStream> Starts;
+};
+
+/// The merged functions of one range of ids, kept in a temporary file
+/// until all ranges are done.
+struct Chunk {
+    FILE *Fp = nullptr;
+    // Function table of a binary chunk, offsets are relative to the chunk.
+    vector<FunctionEntry> Table;
+    uint64_t Size = 0;
+    string Error;
+};
+
+/// A path of the function being merged. Bound is the bound on the
+/// unlisted paths of the input it was read from.
+struct MergedPath {
+    uint64_t Id, Count, Error, Bound;
+    PathTime Time;
+};
+
+/// Call \p F(I) for each I in [0, N), spread over \p Threads threads.
+template <typename Fn> void parallelFor(size_t N, unsigned Threads, Fn F) {
+    atomic<size_t> Next(0);
+    auto Worker = [&]() {
+        for (size_t I = Next++; I < N; I = Next++) {
+            F(I);
+        }
+    };
+    vector<thread> Pool;
+    for (size_t T = 1; T < min<size_t>(Threads, N); T++) {
+        Pool.emplace_back(Worker);
+    }
+    Worker();
+    for (auto &T : Pool) {
+        T.join();
+    }
+}
+
+uint64_t scaleCount(uint64_t Count, double Scale) {
+    return Scale == 1.0 ? Count : uint64_t(llround(Count * Scale));
+}
+
+/// Map an input and check that it is well formed with its functions in
+/// ascending id order, which the merge relies on.
+bool scanInput(Input &In, const string &Path) {
+    if (!In.Reader.open(Path.c_str())) {
+        In.Error = "could not read profile '" + Path + "'";
+        return false;
+    }
+    FunctionStream S(In.Reader);
+    uint32_t Id;
+    PathCursor C;
+    bool First = true;
+    while (S.next(Id, C)) {
+        if (!First && Id <= In.MaxId) {
+            In.Error = "functions of '" + Path + "' are not sorted by id";
+            return false;
+        }
+        First    = false;
+        In.MaxId = Id;
+        uint64_t PathId, Count;
+        while (C.remaining()) {
+            if (!C.next(PathId, Count)) {
+                In.Error = "invalid profile '" + Path + "'";
+                return false;
+            }
+            In.Total += Count;
+        }
+    }
+    if (S.malformed()) {
+        In.Error = "invalid profile '" + Path + "'";
+        return false;
+    }
+    return true;
+}
+
+/// Merge the functions of range \p Range, which ends before id \p Hi, of
+/// all inputs into \p Out. Each input starts at its first function in the
+/// range, a heap orders the inputs by their next function id.
+void mergeRange(vector<Input> &Inputs, size_t Range, uint64_t Hi,
+                ProfileFormat Format, Chunk &Out) {
+    Out.Fp = tmpfile();
+    if (!Out.Fp) {
+        Out.Error = string("could not create a temporary file: ") +
+                    strerror(errno);
+        return;
+    }
+
+    size_t N = Inputs.size();
+    vector<FunctionStream> Streams(N);
+    vector<PathCursor> Cursors(N);
+    using Head = pair<uint32_t, size_t>;
+    priority_queue<Head, vector<Head>, greater<Head>> Heap;
+    auto advance = [&](size_t I) {
+        uint32_t Id;
+        if (Streams[I].next(Id, Cursors[I]) && Id < Hi) {
+            Heap.push({Id, I});
+        }
+    };
+    for (size_t I = 0; I < N; I++) {
+        Streams[I] = Inputs[I].Starts[Range];
+        advance(I);
+    }
+
+    vector<MergedPath> Paths;
+    vector<uint8_t> Records;
+    while (!Heap.empty()) {
+        uint32_t Id      = Heap.top().first;
+        bool Approximate = false;
+        bool Timed       = false;
+        uint64_t Bound   = 0;
+        Paths.clear();
+        while (!Heap.empty() && Heap.top().first == Id) {
+            size_t I = Heap.top().second;
+            Heap.pop();
+            PathCursor &C = Cursors[I];
+            double Scale  = Inputs[I].Scale;
+            Approximate |= C.approximate();
+            Timed |= C.timed();
+            uint64_t InputBound = scaleCount(C.bound(), Scale);
+            Bound += InputBound;
+            uint64_t PathId, Count, Error;
+            PathTime Time;
+            while (C.next(PathId, Count, Error, Time)) {
+                // The longest execution of a path is not scaled.
+                Time.Total = scaleCount(Time.Total, Scale);
+                Paths.push_back({PathId, scaleCount(Count, Scale),
+                                 scaleCount(Error, Scale), InputBound, Time});
+            }
+            advance(I);
+        }
+
+        // Sum the counts of each path over the inputs.
+        sort(Paths.begin(), Paths.end(),
+             [](const MergedPath &P1, const MergedPath &P2) {
+                 return P1.Id < P2.Id;
+             });
+        FunctionProfile F(Id);
+        F.Bound           = Bound;
+        for (size_t I = 0; I < Paths.size();) {
+            MergedPath Sum = Paths[I];
+            for (I++; I < Paths.size() && Paths[I].Id == Sum.Id; I++) {
+                Sum.Count += Paths[I].Count;
+                Sum.Error += Paths[I].Error;
+                Sum.Bound += Paths[I].Bound;
+                Sum.Time.Total += Paths[I].Time.Total;
+                Sum.Time.Max = max(Sum.Time.Max, Paths[I].Time.Max);
+            }
+            // An approximate input which evicted the path may have executed
+            // it up to its bound, like HeavyHitterSummary::merge.
+            Sum.Count += Bound - Sum.Bound;
+            Sum.Error += Bound - Sum.Bound;
+            // A small weight may scale a count down to nothing.
+            if (!Sum.Count) {
+                continue;
+            }
+            F.Paths.emplace_back(Sum.Id, Sum.Count);
+            if (Approximate) {
+                F.Errors.push_back(Sum.Error);
+            }
+            if (Timed) {
+                F.Times.push_back(Sum.Time);
+            }
+        }
+        if (F.Paths.empty()) {
+            continue;
+        }
+
+        if (Format == TextProfile) {
+            writeTextFunction(Out.Fp, F);
+            continue;
+        }
+        Records.clear();
+        FunctionEntry E = encodeBinaryFunction(Records, F);
+        E.Offset += Out.Size;
+        Out.Table.push_back(E);
+        fwrite(Records.data(), 1, Records.size(), Out.Fp);
+        Out.Size += Records.size();
+    }
+
+    if (ferror(Out.Fp)) {
+        Out.Error = "error writing a temporary file";
+    }
+}
+
+} // namespace
+
+bool epp::mergeProfiles(const vector<MergeInput> &Inputs,
+                        const string &Output, const MergeOptions &Options,
+                        string &Error) {
+    if (Inputs.empty()) {
+        Error = "no profiles to merge";
+        return false;
+    }
+    unsigned Threads = Options.Threads;
+    if (!Threads) {
+        Threads = max(1u, thread::hardware_concurrency());
+    }
+
+    // First pass: map and validate every input.
+    vector<Input> In(Inputs.size());
+    parallelFor(In.size(), Threads,
+                [&](size_t I) { scanInput(In[I], Inputs[I].Path); });
+    for (auto &I : In) {
+        if (!I.Error.empty()) {
+            Error = I.Error;
+            return false;
+        }
+    }
+
+    // Path ids are only comparable within one module.
+    ProfileInfo Info;
+    Info.ModuleHash = In[0].Reader.info().ModuleHash;
+    for (size_t I = 1; I < In.size(); I++) {
+        if (In[I].Reader.info().ModuleHash != Info.ModuleHash) {
+            Error = "'" + Inputs[I].Path +
+                    "' was not profiled from the same module as '" +
+                    Inputs[0].Path + "'";
+            return false;
+        }
+    }
+
+    // Sampled counts are scaled back, so the merged profile is not
+    // sampled itself.
+    double Average = 0;
+    for (auto &I : In) {
+        Average += I.Total * I.Reader.sampling().scale() / In.size();
+    }
+    for (size_t I = 0; I < In.size(); I++) {
+        double Scale = In[I].Reader.sampling().scale();
+        if (Options.Normalize && In[I].Total) {
+            Scale = Average / In[I].Total;
+        }
+        In[I].Scale = Scale * Inputs[I].Weight;
+    }
+
+    // Split the function ids into more ranges than threads to balance the
+    // load, and find where each range starts in each input.
+    uint64_t NumIds = 0;
+    for (auto &I : In) {
+        NumIds = max<uint64_t>(NumIds, I.MaxId + 1);
+    }
+    size_t NumRanges = min<uint64_t>(Threads * 4, NumIds);
+    vector<uint64_t> Bounds;
+    for (size_t R = 0; R <= NumRanges; R++) {
+        Bounds.push_back(NumIds * R / max<size_t>(NumRanges, 1));
+    }
+    parallelFor(In.size(), Threads, [&](size_t I) {
+        FunctionStream S(In[I].Reader);
+        for (size_t R = 0; R < NumRanges; R++) {
+            S.seek(Bounds[R]);
+            In[I].Starts.push_back(S);
+        }
+    });
+
+    vector<Chunk> Chunks(NumRanges);
+    parallelFor(NumRanges, Threads, [&](size_t R) {
+        mergeRange(In, R, Bounds[R + 1], Options.Format, Chunks[R]);
+    });
+
+    FILE *Fp = fopen(Output.c_str(), "wb");
+    bool Ok  = Fp != nullptr;
+    if (!Ok) {
+        Error = "could not write profile '" + Output + "': " + strerror(errno);
+    }
+    for (auto &C : Chunks) {
+        if (Ok && !C.Error.empty()) {
+            Error = C.Error;
+            Ok    = false;
+        }
+    }
+
+    if (Ok && Options.Format == TextProfile) {
+        writeTextHeader(Fp, Info);
+    } else if (Ok) {
+        vector<FunctionEntry> Table;
+        uint64_t Offset = 0;
+        for (auto &C : Chunks) {
+            for (auto E : C.Table) {
+                E.Offset += Offset;
+                Table.push_back(E);
+            }
+            Offset += C.Size;
+        }
+        writeBinaryHeader(Fp, Table, Info);
+    }
+
+    vector<char> Buffer(1 << 16);
+    for (auto &C : Chunks) {
+        if (!C.Fp) {
+            continue;
+        }
+        rewind(C.Fp);
+        size_t Read;
+        while (Ok && (Read = fread(Buffer.data(), 1, Buffer.size(), C.Fp))) {
+            fwrite(Buffer.data(), 1, Read, Fp);
+        }
+        fclose(C.Fp);
+    }
+
+    if (Fp) {
+        if (Ok && ferror(Fp)) {
+            Error = "error writing profile '" + Output + "'";
+            Ok    = false;
+        }
+        fclose(Fp);
+    }
+    return Ok;
+}
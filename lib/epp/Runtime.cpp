@@ -1,93 +1,1647 @@
 #include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
 #include <cinttypes>
+#include <csignal>
 #include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
 #include <iostream>
-#include <list>
-#include <map>
+#include <memory>
 #include <mutex>
+#include <shared_mutex>
+#include <string>
 #include <thread>
 #include <unordered_map>
 #include <vector>
 
+#include <pthread.h>
+#include <semaphore.h>
+#include <unistd.h>
+
+#include "EPPProfileFormat.h"
+#include "EPPRuntime.h"
+#include "HeavyHitters.h"
+#include "PathTable.h"
+#include "PathTimes.h"
+
 using namespace std;
+using namespace epp;
 
 #define EPP(X) __epp_##X
 
 extern uint32_t EPP(numberOfFunctions);
+extern uint64_t EPP(shardWords);
+
+using TLSDataTy = vector<PathTable>;
+
+// Protects the registration of array and sharded counters.
+mutex registerMutex;
+
+// The format __epp_save writes, chosen by llvm-epp -profile-format.
+uint32_t GlobalProfileFormat = TextProfile;
+
+// The file __epp_save writes, also used for periodic and signal triggered
+// dumps while the program is running. It is expanded from the path given
+// to llvm-epp -o, or from EPP_PROFILE_OUTPUT, see expandProfilePath.
+string GlobalProfileTemplate;
+string GlobalProfilePath;
+
+// Functions with few paths are counted by the instrumented code directly
+// in a static array indexed by path id, see EPPProfile::instrument.
+struct ArrayCounterTy {
+    uint32_t FunctionId;
+    uint64_t *Counts;
+    uint64_t NumPaths;
+};
+vector<ArrayCounterTy> GlobalArrayCounters;
+
+// In continuous mode the array counters of the module are allocated in a
+// single block, which the runtime moves into a shared mapping of a file so
+// that the counts survive a crash, see mapContinuousCounters. Block is the
+// module's pointer to the block, which its log sites load.
+struct ContinuousTy {
+    uint64_t **Block = nullptr;
+    uint64_t Words   = 0;
+    void *Map        = nullptr;
+    size_t MapSize   = 0;
+} Continuous;
+
+// Sharded array mode functions are counted by each thread in a private,
+// cache line aligned shard which holds the counters of all such functions.
+// The shards are reduced when the profile is saved.
+struct ShardedCounterTy {
+    uint32_t FunctionId;
+    uint64_t Offset;
+    uint64_t NumPaths;
+};
+vector<ShardedCounterTy> GlobalShardedCounters;
+
+// Functions with too many executed paths to count exactly are counted by
+// each thread in a SpaceSaving summary of fixed capacity instead of a path
+// table, see the -heavy-hitters option of llvm-epp. Their log sites are
+// unchanged: their path tables stay empty so every path takes the slow
+// path, which looks up the summary in HeavyHitterIndex.
+struct HeavyHitterTy {
+    uint32_t FunctionId;
+    uint32_t Capacity;
+};
+vector<HeavyHitterTy> GlobalHeavyHitters;
+
+// Index into GlobalHeavyHitters by function id, -1 for functions which are
+// counted exactly. Empty if there are no heavy hitter functions.
+vector<int32_t> HeavyHitterIndex;
+
+extern "C" {
+// The directory of path tables of the current thread, see lookupPathTable.
+// This is read by the fast path in RuntimeInline.cpp which may be inlined
+// into the instrumented program, so it must stay a plain initial-exec TLS
+// pointer without a C++ TLS wrapper.
+__thread PathTable **EPP(tables) __attribute__((tls_model("initial-exec"))) =
+    nullptr;
+
+__thread uint64_t *EPP(shard) __attribute__((tls_model("initial-exec"))) =
+    nullptr;
+
+// In sampling mode each log site decrements this and calls
+// EPP(logPathSampled) when it reaches zero.
+__thread int64_t EPP(sampleCountdown)
+    __attribute__((tls_model("initial-exec"))) = 1;
+
+// Functions instrumented with -switchable check this flag on entry and run
+// their uninstrumented copy while it is clear. Set from EPP_ENABLE by
+// EPP(init), then by EPP(enable) and EPP(disable).
+uint8_t EPP(enabled) = 0;
+}
+
+// Sampling parameters, see the -sample-period option of llvm-epp. Each
+// thread logs a burst of Burst paths, then skips Period - Burst paths.
+SamplingInfo GlobalSampling;
+__thread uint32_t SampleBurstLeft = 0;
+
+// Hash of the instrumented module, recorded in the profile.
+uint64_t GlobalModuleHash = 0;
+
+// Pages of the directory which have not been allocated yet point to this
+// page of empty tables. An empty table never matches in tryInc, so the
+// fast path falls through to EPP(logPathSlow) which allocates the page.
+PathTable EmptyPage[PathTablePageSize];
+
+uint32_t numPages() {
+    return (EPP(numberOfFunctions) + PathTablePageMask) >> PathTablePageBits;
+}
+
+// Statistics about the runtime, see EPPStats. Each thread counts the work
+// done on its slow path, the fast path is not instrumented: the number of
+// paths logged and the probe lengths are recovered from the counts and
+// the path tables when the statistics are read.
+struct ThreadStats {
+    atomic<uint64_t> SlowPathCalls{0};
+    atomic<uint64_t> TableResizes{0};
+    atomic<uint64_t> BytesAllocated{0};
+};
+
+/// Add to a statistic only ever updated by one thread.
+void bumpStat(atomic<uint64_t> &Stat, uint64_t V) {
+    Stat.store(Stat.load(memory_order_relaxed) + V, memory_order_relaxed);
+}
+
+// Add an "# stats" trailer to each profile written, EPP_STATS.
+bool StatsTrailer = false;
+
+// Start text profiles with the "# module" line, EPP_MODULE_HASH. Binary
+// profiles always record the module hash in their header.
+bool ModuleLine = false;
+
+// Saves and dumps of the profile completed so far and their total time.
+atomic<uint64_t> Saves(0);
+atomic<uint64_t> SaveNanos(0);
+
+// Every thread which logs a path owns a node in a lock free list. The node
+// publishes the thread's path tables and shard to snapshots. When the
+// thread exits its counts are folded into the exited thread accumulators
+// below, its storage is freed and the node is marked free so that the next
+// new thread can claim it. Nodes themselves are never freed, so the list
+// is as long as the largest number of threads which were alive at once.
+struct ThreadNode {
+    ThreadNode *Next = nullptr;
+    atomic<bool> InUse{true};
+    atomic<PathTable **> Tables{nullptr};
+    atomic<uint64_t *> Shard{nullptr};
+    atomic<SpaceSaving **> Summaries{nullptr};
+    atomic<PathTimes *> Times{nullptr};
+    ThreadStats Stats;
+    uint32_t Index = 0;
+};
+atomic<ThreadNode *> ThreadList(nullptr);
+
+// Threads are numbered in the order they register, for per thread dumps.
+atomic<uint32_t> NextThreadIndex(0);
+
+// Write the counts of each thread to its own profile, EPP_PER_THREAD_DUMP.
+bool PerThreadDump = false;
+
+void writeThreadProfile(ThreadNode *N);
+
+// Counts of exited threads. Path tables are merged into pages allocated on
+// demand, under a lock striped by page so that threads exiting together
+// rarely contend. Shards are added with atomic adds.
+const uint32_t NumAccumulatorLocks = 64;
+mutex AccumulatorLocks[NumAccumulatorLocks];
+unique_ptr<unique_ptr<PathTable[]>[]> ExitedPages;
+unique_ptr<uint64_t[]> ExitedShard;
+mutex ExitedSummariesMutex;
+vector<HeavyHitterSummary> ExitedSummaries;
+mutex ExitedTimesMutex;
+PathTimes ExitedTimes;
+ThreadStats ExitedStats;
+
+// Held shared by exiting threads while they move their counts into the
+// accumulators and exclusively by snapshots, so that a snapshot sees each
+// count either in the thread or in the accumulators, never both or neither.
+shared_timed_mutex ExitMutex;
+
+__thread ThreadNode *CurrentNode       = nullptr;
+__thread bool ThreadExited             = false;
+__thread SpaceSaving **ThreadSummaries = nullptr;
+__thread PathTimes *ThreadTimes        = nullptr;
+
+ThreadNode *claimNode() {
+    ThreadNode *Head = ThreadList.load(memory_order_acquire);
+    for (ThreadNode *N = Head; N; N = N->Next) {
+        bool Free = false;
+        if (!N->InUse.load(memory_order_relaxed) &&
+            N->InUse.compare_exchange_strong(Free, true)) {
+            N->Index = NextThreadIndex++;
+            return N;
+        }
+    }
+    auto *N  = new ThreadNode();
+    N->Index = NextThreadIndex++;
+    N->Next  = Head;
+    while (!ThreadList.compare_exchange_weak(N->Next, N)) {
+    }
+    return N;
+}
+
+/// Free the path tables, shard, heavy hitter summaries and path times of a
+/// thread and reset its statistics, once its counts have been merged or
+/// discarded.
+void freeThreadCounters(ThreadNode *N) {
+    if (PathTable **Tables = N->Tables.exchange(nullptr)) {
+        for (uint32_t P = 0; P < numPages(); P++) {
+            if (Tables[P] != EmptyPage) {
+                delete[] Tables[P];
+            }
+        }
+        delete[] Tables;
+    }
+    free(N->Shard.exchange(nullptr));
+    if (SpaceSaving **Summaries = N->Summaries.exchange(nullptr)) {
+        for (uint32_t H = 0; H < GlobalHeavyHitters.size(); H++) {
+            delete Summaries[H];
+        }
+        delete[] Summaries;
+    }
+    delete N->Times.exchange(nullptr);
+    N->Stats.SlowPathCalls.store(0, memory_order_relaxed);
+    N->Stats.TableResizes.store(0, memory_order_relaxed);
+    N->Stats.BytesAllocated.store(0, memory_order_relaxed);
+}
 
-using TLSDataTy = vector<unordered_map<uint64_t, uint64_t>>;
-list<shared_ptr<TLSDataTy>> GlobalEPPDataList;
+// Set in a child process by childAfterFork. The first call into the
+// runtime in the child finishes resetting its state, see finishFork.
+atomic<bool> ForkPending(false);
+void finishFork();
 
-mutex tlsMutex;
+void finishForkIfPending() {
+    if (ForkPending.load(memory_order_acquire)) {
+        finishFork();
+    }
+}
 
 class EPP(data) {
-    shared_ptr<TLSDataTy> Ptr;
+    ThreadNode *Node;
 
   public:
-    void log(uint64_t Val, uint64_t FunctionId) {
-        (*Ptr)[FunctionId][Val] += 1;
-    }
+    EPP(data)() { Node = CurrentNode = claimNode(); }
+
+    /// Fold the counts of the exiting thread into the accumulators and
+    /// release its node.
+    ~EPP(data)() {
+        finishForkIfPending();
+        if (PerThreadDump) {
+            writeThreadProfile(Node);
+        }
+
+        shared_lock<shared_timed_mutex> lock(ExitMutex);
+
+        if (PathTable **Tables = Node->Tables.load(memory_order_relaxed)) {
+            for (uint32_t P = 0; P < numPages(); P++) {
+                if (Tables[P] == EmptyPage) {
+                    continue;
+                }
+                lock_guard<mutex> stripe(
+                    AccumulatorLocks[P % NumAccumulatorLocks]);
+                auto &Exited = ExitedPages[P];
+                if (!Exited) {
+                    Exited.reset(new PathTable[PathTablePageSize]);
+                }
+                for (uint32_t I = 0; I < PathTablePageSize; I++) {
+                    Tables[P][I].forEach([&Exited, I](uint64_t Path,
+                                                      uint64_t Count) {
+                        Exited[I].add(Path, Count);
+                    });
+                }
+            }
+        }
+
+        if (uint64_t *Shard = Node->Shard.load(memory_order_relaxed)) {
+            for (uint64_t W = 0; W < EPP(shardWords); W++) {
+                if (Shard[W]) {
+                    __atomic_fetch_add(&ExitedShard[W], Shard[W],
+                                       __ATOMIC_RELAXED);
+                }
+            }
+        }
+
+        if (SpaceSaving **Summaries =
+                Node->Summaries.load(memory_order_relaxed)) {
+            lock_guard<mutex> exited(ExitedSummariesMutex);
+            HeavyHitterSummary S;
+            for (uint32_t H = 0; H < GlobalHeavyHitters.size(); H++) {
+                if (Summaries[H]) {
+                    Summaries[H]->snapshot(S);
+                    ExitedSummaries[H].merge(S, GlobalHeavyHitters[H].Capacity);
+                }
+            }
+        }
+
+        if (PathTimes *Times = Node->Times.load(memory_order_relaxed)) {
+            lock_guard<mutex> exited(ExitedTimesMutex);
+            vector<TimedPath> Paths;
+            Times->snapshot(Paths);
+            for (auto &P : Paths) {
+                ExitedTimes.add(P.FunctionId, P.Path, P.Time);
+            }
+        }
+
+        for (auto Stat : {&ThreadStats::SlowPathCalls,
+                          &ThreadStats::TableResizes,
+                          &ThreadStats::BytesAllocated}) {
+            ExitedStats.*Stat += (Node->Stats.*Stat).load();
+        }
+        freeThreadCounters(Node);
 
-    EPP(data)() {
-        lock_guard<mutex> lock(tlsMutex);
-        Ptr = make_shared<TLSDataTy>();
-        GlobalEPPDataList.push_back(Ptr);
-        // Allocate an unordered_map for each function even though we know it
-        // may not be used. This is to make the lookup faster at runtime.
-        Ptr->resize(EPP(numberOfFunctions));
+        EPP(tables)     = nullptr;
+        EPP(shard)      = nullptr;
+        ThreadSummaries = nullptr;
+        ThreadTimes     = nullptr;
+        CurrentNode     = nullptr;
+        ThreadExited    = true;
+        Node->InUse.store(false, memory_order_release);
     }
 };
 
-thread_local unique_ptr<EPP(data)> Data = make_unique<EPP(data)>();
+thread_local unique_ptr<EPP(data)> Data;
 
-extern "C" {
+/// The node of the current thread, registering the thread if needed. A
+/// thread which logs paths after its EPP(data) was destroyed, from the
+/// destructor of another thread local object, gets a node which is never
+/// released. Its counts are still seen by snapshots.
+ThreadNode *currentNode() {
+    finishForkIfPending();
+    if (!CurrentNode) {
+        if (ThreadExited) {
+            CurrentNode = claimNode();
+        } else {
+            Data = make_unique<EPP(data)>();
+        }
+    }
+    return CurrentNode;
+}
 
-void EPP(init)() {}
+// Snapshots of the counters are taken while the program keeps running,
+// either by the dump thread or when the profile is saved at exit. Readers
+// are serialized by SnapshotMutex and never block the logging threads:
+// path tables are read under their sequence lock (PathTable::snapshot) and
+// counters with relaxed loads. Storage released by a table resize while a
+// snapshot is running is kept until the snapshot completes.
+mutex SnapshotMutex;
+atomic<bool> SnapshotActive(false);
+mutex RetiredMutex;
+vector<void *> RetiredStorage;
 
-void EPP(logPath)(uint64_t Val, uint64_t FunctionId) {
-    if (Data) {
-        Data->log(Val, FunctionId);
+void releaseTableStorage(void *P) {
+    // Pairs with the fence in takeSnapshot, either the snapshot sees the
+    // new storage of the table or we see that the snapshot is running.
+    atomic_thread_fence(memory_order_seq_cst);
+    if (!SnapshotActive.load(memory_order_relaxed)) {
+        free(P);
+        return;
     }
+    lock_guard<mutex> lock(RetiredMutex);
+    RetiredStorage.push_back(P);
 }
 
-void EPP(save)(char *path) {
+uint64_t loadCounter(const uint64_t *P) {
+    return __atomic_load_n(P, __ATOMIC_RELAXED);
+}
 
-    FILE *fp = fopen(path, "w");
+/// Add the counts of the functions in pages [FirstPage, LastPage) of the
+/// path tables \p Tables and of the shard \p Shard to \p Accumulate, which
+/// holds the tables of these pages only.
+void addThreadPages(PathTable **Tables, const uint64_t *Shard,
+                    uint32_t FirstPage, uint32_t LastPage,
+                    TLSDataTy &Accumulate, ProbeStats *Probes = nullptr) {
+    uint32_t First = FirstPage << PathTablePageBits;
+    uint32_t Last  = LastPage << PathTablePageBits;
+    vector<pair<uint64_t, uint64_t>> Paths;
 
-    // TODO: Modify to enable option of per thread dump
+    for (uint32_t P = FirstPage; Tables && P < LastPage; P++) {
+        PathTable *Page = __atomic_load_n(&Tables[P], __ATOMIC_ACQUIRE);
+        if (Page == EmptyPage) {
+            continue;
+        }
+        for (uint32_t I = 0; I < PathTablePageSize; I++) {
+            Paths.clear();
+            Page[I].snapshot(Paths, Probes);
+            auto &Sum = Accumulate[((P - FirstPage) << PathTablePageBits) + I];
+            for (auto &KV : Paths) {
+                Sum.add(KV.first, KV.second);
+            }
+        }
+    }
 
-    TLSDataTy Accumulate(EPP(numberOfFunctions));
+    for (const auto &S : GlobalShardedCounters) {
+        if (!Shard || S.FunctionId < First || S.FunctionId >= Last) {
+            continue;
+        }
+        for (uint64_t P = 0; P < S.NumPaths; P++) {
+            Accumulate[S.FunctionId - First].add(
+                P, loadCounter(&Shard[S.Offset + P]));
+        }
+    }
+}
+
+/// Merge the heavy hitter summaries \p Summaries of one thread for the
+/// functions in [First, Last) into \p Accumulate, indexed like
+/// GlobalHeavyHitters.
+void addThreadSummaries(SpaceSaving **Summaries, uint32_t First,
+                        uint32_t Last,
+                        vector<HeavyHitterSummary> &Accumulate) {
+    HeavyHitterSummary S;
+    for (uint32_t H = 0; Summaries && H < GlobalHeavyHitters.size(); H++) {
+        const auto &HH = GlobalHeavyHitters[H];
+        if (HH.FunctionId < First || HH.FunctionId >= Last) {
+            continue;
+        }
+        if (SpaceSaving *T =
+                __atomic_load_n(&Summaries[H], __ATOMIC_ACQUIRE)) {
+            T->snapshot(S);
+            Accumulate[H].merge(S, HH.Capacity);
+        }
+    }
+}
 
-    for (const auto &T : GlobalEPPDataList) {
-        for (uint32_t I = 0; I < T->size(); I++) {
-            for (auto &KV : T->at(I)) {
-                Accumulate[I][KV.first] += KV.second;
+/// Add the approximate profiles of the heavy hitter functions in
+/// [First, Last) from \p Accumulate to \p Profile, which holds the exact
+/// functions of the same range, keeping it sorted by function id.
+void collectHeavyHitters(vector<HeavyHitterSummary> &Accumulate,
+                         uint32_t First, uint32_t Last,
+                         vector<FunctionProfile> &Profile) {
+    size_t Exact = Profile.size();
+    for (uint32_t H = 0; H < GlobalHeavyHitters.size(); H++) {
+        uint32_t FunctionId = GlobalHeavyHitters[H].FunctionId;
+        if (FunctionId < First || FunctionId >= Last ||
+            Accumulate[H].Paths.empty()) {
+            continue;
+        }
+        Profile.emplace_back(FunctionId);
+        auto &F = Profile.back();
+        F.Bound = Accumulate[H].Bound;
+        for (auto &HH : Accumulate[H].Paths) {
+            F.Paths.emplace_back(HH.Path, HH.Count);
+            F.Errors.push_back(HH.Error);
+        }
+        sortPaths(F, ProfileFormat(GlobalProfileFormat));
+    }
+    auto ById = [](const FunctionProfile &F1, const FunctionProfile &F2) {
+        return F1.FunctionId < F2.FunctionId;
+    };
+    sort(Profile.begin() + Exact, Profile.end(), ById);
+    inplace_merge(Profile.begin(), Profile.begin() + Exact, Profile.end(),
+                  ById);
+}
+
+/// Collect the executed paths of each function from \p Accumulate, which
+/// holds the tables of the functions starting at \p First, sorted in the
+/// order they are written.
+void collectProfile(TLSDataTy &Accumulate, uint32_t First,
+                    vector<FunctionProfile> &Profile) {
+    for (uint32_t I = 0; I < Accumulate.size(); I++) {
+        if (Accumulate[I].empty()) {
+            continue;
+        }
+        Profile.emplace_back(First + I);
+        auto &Values = Profile.back().Paths;
+        Values.reserve(Accumulate[I].size());
+        Accumulate[I].forEach([&Values](uint64_t Path, uint64_t Count) {
+            Values.emplace_back(Path, Count);
+        });
+        sortPaths(Profile.back(), ProfileFormat(GlobalProfileFormat));
+    }
+}
+
+/// Merge the counts of all threads, exited threads, array and sharded
+/// counters for the functions in pages [FirstPage, LastPage). The probe
+/// lengths of the live path tables are added to \p Probes if it is given.
+void mergePages(uint32_t FirstPage, uint32_t LastPage,
+                vector<FunctionProfile> &Profile, ProbeStats *Probes) {
+    uint32_t First = FirstPage << PathTablePageBits;
+    uint32_t Last =
+        min(LastPage << PathTablePageBits, EPP(numberOfFunctions));
+    TLSDataTy Accumulate((LastPage - FirstPage) << PathTablePageBits);
+    vector<HeavyHitterSummary> Summaries(GlobalHeavyHitters.size());
+
+    for (ThreadNode *N = ThreadList.load(memory_order_acquire); N;
+         N = N->Next) {
+        addThreadPages(N->Tables.load(memory_order_acquire),
+                       N->Shard.load(memory_order_acquire), FirstPage,
+                       LastPage, Accumulate, Probes);
+        addThreadSummaries(N->Summaries.load(memory_order_acquire), First,
+                           Last, Summaries);
+    }
+    addThreadPages(nullptr, ExitedShard.get(), FirstPage, LastPage,
+                   Accumulate);
+
+    for (uint32_t P = FirstPage; P < LastPage; P++) {
+        lock_guard<mutex> stripe(AccumulatorLocks[P % NumAccumulatorLocks]);
+        if (!ExitedPages[P]) {
+            continue;
+        }
+        for (uint32_t I = 0; I < PathTablePageSize; I++) {
+            auto &Sum = Accumulate[((P - FirstPage) << PathTablePageBits) + I];
+            ExitedPages[P][I].forEach([&Sum](uint64_t Path, uint64_t Count) {
+                Sum.add(Path, Count);
+            });
+        }
+    }
+
+    for (const auto &A : GlobalArrayCounters) {
+        if (A.FunctionId < First || A.FunctionId >= Last) {
+            continue;
+        }
+        for (uint64_t P = 0; P < A.NumPaths; P++) {
+            Accumulate[A.FunctionId - First].add(P, loadCounter(&A.Counts[P]));
+        }
+    }
+
+    {
+        lock_guard<mutex> exited(ExitedSummariesMutex);
+        for (uint32_t H = 0; H < GlobalHeavyHitters.size(); H++) {
+            const auto &HH = GlobalHeavyHitters[H];
+            if (HH.FunctionId >= First && HH.FunctionId < Last) {
+                Summaries[H].merge(ExitedSummaries[H], HH.Capacity);
             }
         }
     }
 
+    Accumulate.resize(Last - First);
+    collectProfile(Accumulate, First, Profile);
+    collectHeavyHitters(Summaries, First, Last, Profile);
+}
+
+/// Attach the cycles spent on the paths of timed functions, summed over all
+/// threads, to \p Profile which is sorted by function id. Paths which were
+/// counted but whose time was not recorded yet get a zero time.
+void collectPathTimes(vector<FunctionProfile> &Profile) {
+    vector<TimedPath> Paths;
+    for (ThreadNode *N = ThreadList.load(memory_order_acquire); N;
+         N = N->Next) {
+        if (PathTimes *Times = N->Times.load(memory_order_acquire)) {
+            Times->snapshot(Paths);
+        }
+    }
+    {
+        lock_guard<mutex> exited(ExitedTimesMutex);
+        ExitedTimes.snapshot(Paths);
+    }
+    if (Paths.empty()) {
+        return;
+    }
+
+    auto ByPath = [](const TimedPath &P1, const TimedPath &P2) {
+        return P1.FunctionId < P2.FunctionId ||
+               (P1.FunctionId == P2.FunctionId && P1.Path < P2.Path);
+    };
+    sort(Paths.begin(), Paths.end(), ByPath);
+    size_t Size = 0;
+    for (size_t I = 0; I < Paths.size(); I++) {
+        if (Size && !ByPath(Paths[Size - 1], Paths[I])) {
+            Paths[Size - 1].Time.Total += Paths[I].Time.Total;
+            Paths[Size - 1].Time.Max =
+                max(Paths[Size - 1].Time.Max, Paths[I].Time.Max);
+        } else {
+            Paths[Size++] = Paths[I];
+        }
+    }
+    Paths.resize(Size);
+
+    auto T = Paths.begin();
+    for (auto &F : Profile) {
+        while (T != Paths.end() && T->FunctionId < F.FunctionId) {
+            T++;
+        }
+        auto End = T;
+        while (End != Paths.end() && End->FunctionId == F.FunctionId) {
+            End++;
+        }
+        if (T == End) {
+            continue;
+        }
+        for (auto &P : F.Paths) {
+            TimedPath Key = {F.FunctionId, P.first, {}};
+            auto It       = lower_bound(T, End, Key, ByPath);
+            F.Times.push_back(It != End && It->Path == P.first ? It->Time
+                                                               : PathTime());
+        }
+        T = End;
+    }
+}
+
+/// Number of threads used to merge the profile, EPP_MERGE_THREADS or the
+/// number of cores by default.
+unsigned mergeThreads() {
+    if (const char *N = getenv("EPP_MERGE_THREADS")) {
+        return max(atoi(N), 1);
+    }
+    return max(thread::hardware_concurrency(), 1u);
+}
+
+void addThreadStats(const ThreadStats &S, EPPStats &Stats) {
+    Stats.SlowPathCalls += S.SlowPathCalls.load(memory_order_relaxed);
+    Stats.TableResizes += S.TableResizes.load(memory_order_relaxed);
+    Stats.BytesAllocated += S.BytesAllocated.load(memory_order_relaxed);
+}
+
+/// Fill in the statistics derived from a snapshot of the profile.
+void addProfileStats(const vector<FunctionProfile> &Profile,
+                     EPPStats &Stats) {
+    for (auto &F : Profile) {
+        Stats.Functions++;
+        Stats.DistinctPaths += F.Paths.size();
+        if (F.Paths.size() > Stats.MaxDistinctPaths) {
+            Stats.MaxDistinctPaths = F.Paths.size();
+            Stats.MaxPathsFunction = F.FunctionId;
+        }
+        for (auto &KV : F.Paths) {
+            Stats.LogCalls += KV.second;
+        }
+    }
+}
+
+/// Holds off exiting threads and keeps the storage released by table
+/// resizes alive, so that the tables of all the threads can be read.
+/// The caller holds SnapshotMutex.
+class SnapshotRegion {
+    unique_lock<shared_timed_mutex> ExitLock;
+    unique_lock<mutex> RegisterLock;
+
+  public:
+    SnapshotRegion() {
+        SnapshotActive.store(true);
+        atomic_thread_fence(memory_order_seq_cst);
+        ExitLock     = unique_lock<shared_timed_mutex>(ExitMutex);
+        RegisterLock = unique_lock<mutex>(registerMutex);
+    }
+
+    ~SnapshotRegion() {
+        RegisterLock.unlock();
+        ExitLock.unlock();
+        SnapshotActive.store(false);
+        lock_guard<mutex> lock(RetiredMutex);
+        for (auto *P : RetiredStorage) {
+            free(P);
+        }
+        RetiredStorage.clear();
+    }
+};
+
+/// Take a snapshot of the whole profile. The function ids are split in
+/// chunks of pages which are merged and sorted in parallel, the chunks are
+/// then concatenated in order so the result does not depend on the number
+/// of threads. If \p Stats is given it is filled in from the same snapshot.
+void takeSnapshot(vector<FunctionProfile> &Profile,
+                  EPPStats *Stats = nullptr) {
+    SnapshotRegion Region;
+
+    if (Stats) {
+        // Read before the counts, so that every slow path counted also
+        // shows up in the profile. Exiting threads are held off, the
+        // counters of each thread are either in its node or in
+        // ExitedStats.
+        memset(Stats, 0, sizeof(EPPStats));
+        Stats->Threads = NextThreadIndex;
+        addThreadStats(ExitedStats, *Stats);
+        for (ThreadNode *N = ThreadList.load(memory_order_acquire); N;
+             N = N->Next) {
+            addThreadStats(N->Stats, *Stats);
+        }
+    }
+
+    // Several chunks per thread balance functions with many paths.
+    uint32_t Pages     = numPages();
+    unsigned Threads   = min(mergeThreads(), Pages);
+    uint32_t NumChunks = min(Pages, Threads * 4);
+    vector<vector<FunctionProfile>> Chunks(NumChunks);
+    vector<ProbeStats> Probes(NumChunks);
+    atomic<uint32_t> NextChunk(0);
+
+    auto Worker = [&]() {
+        uint32_t C;
+        while ((C = NextChunk++) < NumChunks) {
+            mergePages(uint64_t(Pages) * C / NumChunks,
+                       uint64_t(Pages) * (C + 1) / NumChunks, Chunks[C],
+                       Stats ? &Probes[C] : nullptr);
+        }
+    };
+    vector<thread> Workers;
+    for (unsigned T = 1; T < Threads; T++) {
+        Workers.emplace_back(Worker);
+    }
+    Worker();
+    for (auto &W : Workers) {
+        W.join();
+    }
+
+    for (auto &C : Chunks) {
+        move(C.begin(), C.end(), back_inserter(Profile));
+    }
+    collectPathTimes(Profile);
+
+    if (Stats) {
+        for (auto &P : Probes) {
+            Stats->ProbedKeys += P.Keys;
+            Stats->ProbeTotal += P.Total;
+            Stats->ProbeMax = max(Stats->ProbeMax, P.Max);
+        }
+        addProfileStats(Profile, *Stats);
+        Stats->Saves     = Saves;
+        Stats->SaveNanos = SaveNanos;
+    }
+}
+
+/// Append the runtime statistics to a profile as "# stats" lines. Readers
+/// skip comment lines in text profiles and ignore the bytes after the
+/// path records of binary profiles.
+void writeStatsTrailer(FILE *Fp, const EPPStats &Stats) {
+    const pair<const char *, uint64_t> Fields[] = {
+        {"threads", Stats.Threads},
+        {"log_calls", Stats.LogCalls},
+        {"slow_path_calls", Stats.SlowPathCalls},
+        {"table_resizes", Stats.TableResizes},
+        {"bytes_allocated", Stats.BytesAllocated},
+        {"functions", Stats.Functions},
+        {"distinct_paths", Stats.DistinctPaths},
+        {"max_distinct_paths", Stats.MaxDistinctPaths},
+        {"max_paths_function", Stats.MaxPathsFunction},
+        {"probed_keys", Stats.ProbedKeys},
+        {"probe_total", Stats.ProbeTotal},
+        {"probe_max", Stats.ProbeMax},
+        {"saves", Stats.Saves},
+        {"save_ns", Stats.SaveNanos},
+    };
+    for (auto &F : Fields) {
+        fprintf(Fp, "# stats %s %" PRIu64 "\n", F.first, F.second);
+    }
+}
+
+/// The metadata written with a profile in \p Format. Text profiles leave
+/// out the module hash unless EPP_MODULE_HASH is set.
+ProfileInfo profileInfo(uint32_t Format) {
+    ProfileInfo Info;
+    Info.Sampling = GlobalSampling;
+    if (Format == BinaryProfile || ModuleLine) {
+        Info.ModuleHash = GlobalModuleHash;
+    }
+    return Info;
+}
+
+/// Write \p Profile to \p Path, followed by \p Stats if given. The profile
+/// is written to a temporary file first and renamed, so that the file at
+/// \p Path is always a complete profile even while a dump is in progress.
+void writeProfileFile(const string &Path, vector<FunctionProfile> &Profile,
+                      const EPPStats *Stats = nullptr) {
+    string Tmp = Path + ".tmp";
+    FILE *fp   = fopen(Tmp.c_str(), "wb");
+    if (!fp) {
+        cerr << "epp: could not write profile " << Tmp << ": "
+             << strerror(errno) << "\n";
+        return;
+    }
+
+    ProfileInfo Info = profileInfo(GlobalProfileFormat);
+    if (GlobalProfileFormat == BinaryProfile) {
+        writeBinaryProfile(fp, Profile, Info);
+    } else {
+        writeTextProfile(fp, Profile, Info);
+    }
+    if (Stats) {
+        writeStatsTrailer(fp, *Stats);
+    }
+
+    fclose(fp);
+    rename(Tmp.c_str(), Path.c_str());
+}
+
+/// Write a snapshot of the profile to \p Path. The statistics in the
+/// trailer cover the saves before this one.
+void writeProfile(const char *Path) {
+    lock_guard<mutex> lock(SnapshotMutex);
+    auto Start = chrono::steady_clock::now();
+
     // Save the data to a file. Make the dump deterministic by
     // sorting the function ids, and then sorting the paths by
     // their freq/id. The path printer already sorts by freq.
+    vector<FunctionProfile> Profile;
+    EPPStats Stats;
+    takeSnapshot(Profile, StatsTrailer ? &Stats : nullptr);
+    writeProfileFile(Path, Profile, StatsTrailer ? &Stats : nullptr);
 
-    for (uint32_t I = 0; I < Accumulate.size(); I++) {
-        if (!Accumulate[I].empty()) {
-            fprintf(fp, "%u %lu\n", I, Accumulate[I].size());
-            vector<pair<uint64_t, uint64_t>> Values(Accumulate[I].begin(),
-                                                    Accumulate[I].end());
-            sort(Values.begin(), Values.end(),
-                 [](const pair<uint64_t, uint64_t> &P1,
-                    const pair<uint64_t, uint64_t> &P2) {
-                     return (P1.second > P2.second) ||
-                            (P1.second == P2.second && P1.first > P2.first);
-                 });
-            for (auto &KV : Values) {
-                fprintf(fp, "%016" PRIx64 " %" PRIu64 "\n", KV.first,
-                        KV.second);
+    Saves++;
+    SaveNanos += chrono::duration_cast<chrono::nanoseconds>(
+                     chrono::steady_clock::now() - Start)
+                     .count();
+}
+
+/// Collect the counts of a single thread into \p Profile.
+void collectThreadProfile(ThreadNode *N, vector<FunctionProfile> &Profile) {
+    TLSDataTy Accumulate(numPages() << PathTablePageBits);
+    addThreadPages(N->Tables.load(memory_order_acquire),
+                   N->Shard.load(memory_order_acquire), 0, numPages(),
+                   Accumulate);
+    Accumulate.resize(EPP(numberOfFunctions));
+    vector<HeavyHitterSummary> Summaries(GlobalHeavyHitters.size());
+    addThreadSummaries(N->Summaries.load(memory_order_acquire), 0,
+                       EPP(numberOfFunctions), Summaries);
+
+    collectProfile(Accumulate, 0, Profile);
+    collectHeavyHitters(Summaries, 0, EPP(numberOfFunctions), Profile);
+}
+
+/// The path of the profile of the thread with index \p Index, see
+/// EPP_PER_THREAD_DUMP.
+string threadProfilePath(uint32_t Index) {
+    return GlobalProfilePath + "." + to_string(Index);
+}
+
+/// Write the counts of the calling thread to its own profile file.
+void writeThreadProfile(ThreadNode *N) {
+    vector<FunctionProfile> Profile;
+    collectThreadProfile(N, Profile);
+    writeProfileFile(threadProfilePath(N->Index), Profile);
+}
+
+// Epochs split the profile of a run into time windows, to show how its
+// behaviour changes over time. An epoch is closed every EPP_EPOCH_INTERVAL
+// seconds by the dump thread, or when the program calls __epp_advanceEpoch.
+// Closing an epoch takes a snapshot like a dump and appends its difference
+// with the previous snapshot to <profile>.epochs, so the logging threads
+// are not involved at all. Guarded by SnapshotMutex.
+atomic<bool> EpochsEnabled(false);
+uint64_t EpochIndex = 0;
+uint64_t EpochStart = 0;
+vector<FunctionProfile> EpochBase;
+
+uint64_t nowMillis() {
+    return chrono::duration_cast<chrono::milliseconds>(
+               chrono::system_clock::now().time_since_epoch())
+        .count();
+}
+
+/// The counts of \p Now minus those of \p Base, both sorted by function id.
+/// The total cycles of timed paths are subtracted likewise, their maximum is
+/// the largest since the start of the run.
+vector<FunctionProfile> profileDelta(const vector<FunctionProfile> &Now,
+                                     const vector<FunctionProfile> &Base) {
+    vector<FunctionProfile> Delta;
+    // Index of each path of the function in Base.
+    unordered_map<uint64_t, size_t> Before;
+    auto B = Base.begin();
+    for (const auto &F : Now) {
+        while (B != Base.end() && B->FunctionId < F.FunctionId) {
+            B++;
+        }
+        Before.clear();
+        bool Found = B != Base.end() && B->FunctionId == F.FunctionId;
+        for (size_t I = 0; Found && I < B->Paths.size(); I++) {
+            Before[B->Paths[I].first] = I;
+        }
+
+        // A path evicted since the start of the run executed at most as
+        // often in the epoch.
+        FunctionProfile D(F.FunctionId);
+        D.Bound           = F.Bound;
+        for (size_t I = 0; I < F.Paths.size(); I++) {
+            auto It       = Before.find(F.Paths[I].first);
+            bool Seen     = It != Before.end();
+            uint64_t Prev = Seen ? B->Paths[It->second].second : 0;
+            // The counts of heavy hitter summaries are estimates which can
+            // decrease when a path is evicted.
+            if (F.Paths[I].second <= Prev) {
+                continue;
+            }
+            D.Paths.emplace_back(F.Paths[I].first, F.Paths[I].second - Prev);
+            if (F.approximate()) {
+                D.Errors.push_back(F.Errors[I]);
             }
+            if (F.timed()) {
+                PathTime T = F.Times[I];
+                if (Seen && B->timed()) {
+                    T.Total -= min(T.Total, B->Times[It->second].Total);
+                }
+                D.Times.push_back(T);
+            }
+        }
+        if (!D.Paths.empty()) {
+            Delta.push_back(move(D));
         }
     }
+    return Delta;
+}
 
-    fclose(fp);
+/// Append the current epoch to the epochs file and start the next one.
+/// The caller holds SnapshotMutex.
+void closeEpoch() {
+    vector<FunctionProfile> Profile;
+    takeSnapshot(Profile);
+    vector<FunctionProfile> Delta = profileDelta(Profile, EpochBase);
+    EpochInfo E = {EpochIndex, EpochStart, nowMillis()};
+
+    string Path = GlobalProfilePath + ".epochs";
+    FILE *fp    = fopen(Path.c_str(), E.Index ? "a" : "w");
+    if (fp) {
+        if (!E.Index) {
+            writeTextHeader(fp, profileInfo(TextProfile));
+        }
+        writeEpoch(fp, E, Delta);
+        fclose(fp);
+    } else {
+        cerr << "epp: could not write epochs " << Path << ": "
+             << strerror(errno) << "\n";
+    }
+
+    EpochIndex++;
+    EpochStart = E.End;
+    EpochBase  = move(Profile);
+}
+
+// Long running programs can dump their profile while they run. This is
+// configured from the environment:
+//
+//   EPP_DUMP_INTERVAL=<seconds>   dump every N seconds
+//   EPP_DUMP_SIGNAL=<signal>      dump when the signal is received, given
+//                                 as a number or a name such as USR1
+//   EPP_EPOCH_INTERVAL=<seconds>  close an epoch every N seconds
+//
+// All are handled by a dump thread. The signal handler only posts a
+// semaphore, which is async signal safe.
+sem_t DumpRequest;
+unique_ptr<thread> DumpThread;
+atomic<bool> DumpThreadStop(false);
+unsigned DumpInterval  = 0;
+unsigned EpochInterval = 0;
+
+void onDumpSignal(int) {
+    int SavedErrno = errno;
+    sem_post(&DumpRequest);
+    errno = SavedErrno;
+}
+
+/// The time \p Seconds from now. Deadlines are kept on the monotonic
+/// clock, so that changes of the wall clock neither delay nor hasten them.
+timespec deadlineAfter(unsigned Seconds) {
+    timespec T;
+    clock_gettime(CLOCK_MONOTONIC, &T);
+    T.tv_sec += Seconds;
+    return T;
+}
+
+bool earlier(const timespec &T1, const timespec &T2) {
+    return T1.tv_sec < T2.tv_sec ||
+           (T1.tv_sec == T2.tv_sec && T1.tv_nsec < T2.tv_nsec);
+}
+
+bool reached(const timespec &T) { return !earlier(deadlineAfter(0), T); }
+
+/// Wait for a dump request until \p Deadline, returns 0 if one was posted.
+/// sem_timedwait only takes wall clock times, the time left is converted
+/// again after each interruption.
+int waitUntil(const timespec &Deadline) {
+    int R;
+    do {
+        timespec Now = deadlineAfter(0), Wall;
+        clock_gettime(CLOCK_REALTIME, &Wall);
+        if (earlier(Now, Deadline)) {
+            Wall.tv_sec += Deadline.tv_sec - Now.tv_sec;
+            Wall.tv_nsec += Deadline.tv_nsec - Now.tv_nsec;
+            if (Wall.tv_nsec < 0) {
+                Wall.tv_sec--;
+                Wall.tv_nsec += 1000000000;
+            } else if (Wall.tv_nsec >= 1000000000) {
+                Wall.tv_sec++;
+                Wall.tv_nsec -= 1000000000;
+            }
+        }
+        R = sem_timedwait(&DumpRequest, &Wall);
+    } while (R != 0 && errno == EINTR);
+    return R;
+}
+
+/// Move \p T, which was reached, to the first multiple of \p Seconds after
+/// it which is still ahead. Epochs missed while the process was stopped
+/// are skipped rather than closed empty one after the other.
+void nextDeadline(timespec &T, unsigned Seconds) {
+    timespec Now = deadlineAfter(0);
+    T.tv_sec += (Now.tv_sec - T.tv_sec) / Seconds * Seconds;
+    while (!earlier(Now, T)) {
+        T.tv_sec += Seconds;
+    }
+}
+
+void dumpLoop() {
+    timespec NextDump  = deadlineAfter(DumpInterval);
+    timespec NextEpoch = deadlineAfter(EpochInterval);
+    while (true) {
+        int R;
+        if (DumpInterval || EpochInterval) {
+            bool DumpFirst = !EpochInterval ||
+                             (DumpInterval && earlier(NextDump, NextEpoch));
+            R = waitUntil(DumpFirst ? NextDump : NextEpoch);
+        } else {
+            while ((R = sem_wait(&DumpRequest)) != 0 && errno == EINTR) {
+            }
+        }
+        if (DumpThreadStop) {
+            return;
+        }
+        // Woken up by the signal or by the dump deadline.
+        if (R == 0 || (DumpInterval && reached(NextDump))) {
+            writeProfile(GlobalProfilePath.c_str());
+            NextDump = deadlineAfter(DumpInterval);
+        }
+        // Epochs are fixed windows, the next one is not delayed by the
+        // time it takes to close this one.
+        if (EpochInterval && reached(NextEpoch)) {
+            lock_guard<mutex> lock(SnapshotMutex);
+            closeEpoch();
+            nextDeadline(NextEpoch, EpochInterval);
+        }
+    }
+}
+
+int parseSignal(const char *Name) {
+    if (!strncmp(Name, "SIG", 3)) {
+        Name += 3;
+    }
+    if (!strcmp(Name, "USR1")) {
+        return SIGUSR1;
+    }
+    if (!strcmp(Name, "USR2")) {
+        return SIGUSR2;
+    }
+    if (!strcmp(Name, "HUP")) {
+        return SIGHUP;
+    }
+    return atoi(Name);
+}
+
+void startDumpThread() {
+    const char *Interval = getenv("EPP_DUMP_INTERVAL");
+    const char *Signal   = getenv("EPP_DUMP_SIGNAL");
+    const char *Epoch    = getenv("EPP_EPOCH_INTERVAL");
+    DumpInterval         = Interval ? atoi(Interval) : 0;
+    EpochInterval        = Epoch ? atoi(Epoch) : 0;
+    int SigNo            = Signal ? parseSignal(Signal) : 0;
+    if (EpochInterval) {
+        EpochsEnabled = true;
+    }
+    if (!DumpInterval && !EpochInterval && SigNo <= 0) {
+        return;
+    }
+
+    sem_init(&DumpRequest, 0, 0);
+    if (SigNo > 0) {
+        struct sigaction SA;
+        memset(&SA, 0, sizeof(SA));
+        SA.sa_handler = onDumpSignal;
+        SA.sa_flags   = SA_RESTART;
+        sigemptyset(&SA.sa_mask);
+        if (sigaction(SigNo, &SA, nullptr) != 0) {
+            cerr << "epp: invalid EPP_DUMP_SIGNAL " << Signal << "\n";
+        }
+    }
+    DumpThread.reset(new thread(dumpLoop));
+}
+
+void stopDumpThread() {
+    if (DumpThread) {
+        DumpThreadStop = true;
+        sem_post(&DumpRequest);
+        DumpThread->join();
+        DumpThread.reset();
+    }
+}
+
+/// Expand a profile path template: %p is replaced by the process id, %h by
+/// the host name, %t by the time in seconds since the epoch and %% by %.
+string expandProfilePath(const string &Template) {
+    string Path;
+    for (size_t I = 0; I < Template.size(); I++) {
+        if (Template[I] != '%' || I + 1 == Template.size()) {
+            Path += Template[I];
+            continue;
+        }
+        switch (Template[++I]) {
+        case 'p':
+            Path += to_string(getpid());
+            break;
+        case 'h': {
+            char Host[256] = "";
+            gethostname(Host, sizeof(Host) - 1);
+            Path += Host;
+            break;
+        }
+        case 't':
+            Path += to_string(time(nullptr));
+            break;
+        case '%':
+            Path += '%';
+            break;
+        default:
+            Path += '%';
+            Path += Template[I];
+        }
+    }
+    return Path;
+}
+
+/// Move the continuous counter block into a shared mapping of
+/// <profile>.counters. The file is a binary profile which stores each array
+/// function densely, so the kernel writes the counts back to it as they are
+/// updated and it can be read like any profile even if the process is
+/// killed. The counts logged so far are copied over. Paths counted by the
+/// runtime's tables are only saved by dumps.
+void mapContinuousCounters() {
+    uint64_t *Old = *Continuous.Block;
+    vector<FunctionEntry> Table;
+    for (const auto &A : GlobalArrayCounters) {
+        if (A.Counts >= Old && A.Counts < Old + Continuous.Words) {
+            uint64_t Offset = (A.Counts - Old) * sizeof(uint64_t);
+            Table.push_back({A.FunctionId, DenseFunction, A.NumPaths, Offset,
+                             A.NumPaths * sizeof(uint64_t)});
+        }
+    }
+    sort(Table.begin(), Table.end(),
+         [](const FunctionEntry &E1, const FunctionEntry &E2) {
+             return E1.FunctionId < E2.FunctionId;
+         });
+
+    // The counters start on a page boundary after the function table.
+    size_t Page = sysconf(_SC_PAGESIZE);
+    size_t Records =
+        sizeof(ProfileHeader) + Table.size() * sizeof(FunctionEntry);
+    size_t Start = (Records + Page - 1) / Page * Page;
+    size_t Size  = Start + Continuous.Words * sizeof(uint64_t);
+    for (auto &E : Table) {
+        E.Offset += Start - Records;
+    }
+
+    string Path = GlobalProfilePath + ".counters";
+    FILE *fp    = fopen(Path.c_str(), "w+b");
+    void *Map   = MAP_FAILED;
+    if (fp) {
+        ProfileInfo Info;
+        Info.ModuleHash = GlobalModuleHash;
+        writeBinaryHeader(fp, Table, Info);
+        if (fflush(fp) == 0 && ftruncate(fileno(fp), Size) == 0) {
+            Map = mmap(nullptr, Size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                       fileno(fp), 0);
+        }
+        fclose(fp);
+    }
+    if (Map == MAP_FAILED) {
+        cerr << "epp: could not map continuous counters " << Path << ": "
+             << strerror(errno) << "\n";
+        return;
+    }
+
+    auto *New = reinterpret_cast<uint64_t *>(static_cast<char *>(Map) + Start);
+    memcpy(New, Old, Continuous.Words * sizeof(uint64_t));
+    for (auto &A : GlobalArrayCounters) {
+        if (A.Counts >= Old && A.Counts < Old + Continuous.Words) {
+            A.Counts = New + (A.Counts - Old);
+        }
+    }
+    __atomic_store_n(Continuous.Block, New, __ATOMIC_RELEASE);
+    if (Continuous.Map) {
+        munmap(Continuous.Map, Continuous.MapSize);
+    }
+    Continuous.Map     = Map;
+    Continuous.MapSize = Size;
+}
+
+// A child process inherits the counts of its parent: the tables of every
+// thread, including threads which do not exist in the child, and the
+// accumulators. The child starts from an empty profile instead, written to
+// its own file. The locks taken around fork keep the counters consistent
+// while they are copied, logging threads are not affected.
+void prepareFork() {
+    SnapshotMutex.lock();
+    ExitMutex.lock();
+    registerMutex.lock();
+}
+
+void parentAfterFork() {
+    registerMutex.unlock();
+    ExitMutex.unlock();
+    SnapshotMutex.unlock();
+}
+
+/// Runs in the child right after fork, where any lock may have been held by
+/// a thread which no longer exists, so nothing is allocated or freed here.
+/// Only the state which instrumented code uses directly is reset, the rest
+/// is left to finishFork.
+void childAfterFork() {
+    registerMutex.unlock();
+    SnapshotMutex.unlock();
+    // A reader writer lock records the thread id of its writer, which is
+    // different in the child, so it can not be unlocked.
+    new (&ExitMutex) shared_timed_mutex();
+
+    // Only the forking thread survives. Its next path goes through the slow
+    // path, which finishes the reset. Instrumented code on its stack may
+    // still hold a pointer to its shard, so that is cleared in place.
+    EPP(tables)     = nullptr;
+    ThreadSummaries = nullptr;
+    ThreadTimes     = nullptr;
+    if (uint64_t *Shard = CurrentNode ? CurrentNode->Shard.load() : nullptr) {
+        memset(Shard, 0, EPP(shardWords) * sizeof(uint64_t));
+    }
+
+    // The mapping of continuous counters is shared with the parent, replace
+    // it with private zeroed pages until finishFork moves the counters to a
+    // file of the child's own.
+    if (Continuous.Map) {
+        mmap(Continuous.Map, Continuous.MapSize, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+    }
+    for (const auto &A : GlobalArrayCounters) {
+        memset(A.Counts, 0, A.NumPaths * sizeof(uint64_t));
+    }
+
+    EpochStart = nowMillis();
+    ForkPending.store(true, memory_order_release);
+}
+
+/// Whether \p Template has a %p which is not escaped as %%p.
+bool hasPidPattern(const string &Template) {
+    for (size_t I = 0; I + 1 < Template.size(); I++) {
+        if (Template[I] == '%' && Template[++I] == 'p') {
+            return true;
+        }
+    }
+    return false;
+}
+
+/// Discard the counts the child inherited from its parent, move its profile
+/// to a file of its own and restart the dump thread. Called by the first
+/// thread which enters the runtime after fork.
+void finishFork() {
+    {
+        lock_guard<mutex> snapshot(SnapshotMutex);
+        unique_lock<shared_timed_mutex> exitLock(ExitMutex);
+        lock_guard<mutex> lock(registerMutex);
+        if (!ForkPending.load(memory_order_relaxed)) {
+            return;
+        }
+
+        // The shard of the forking thread was cleared in place and may be
+        // in use already, every other counter is stale.
+        ThreadNode *Self = CurrentNode;
+        uint64_t *Shard  = Self ? Self->Shard.exchange(nullptr) : nullptr;
+        for (ThreadNode *N = ThreadList.load(); N; N = N->Next) {
+            freeThreadCounters(N);
+            if (N != Self) {
+                N->InUse.store(false);
+            }
+        }
+        if (Shard) {
+            Self->Shard.store(Shard);
+        }
+        NextThreadIndex = 0;
+        if (Self) {
+            Self->Index = NextThreadIndex++;
+        }
+
+        ExitedPages.reset(new unique_ptr<PathTable[]>[numPages()]);
+        fill(ExitedShard.get(), ExitedShard.get() + EPP(shardWords), 0);
+        ExitedSummaries.assign(GlobalHeavyHitters.size(),
+                               HeavyHitterSummary());
+        ExitedTimes.clear();
+        ExitedStats.SlowPathCalls  = 0;
+        ExitedStats.TableResizes   = 0;
+        ExitedStats.BytesAllocated = 0;
+        Saves                      = 0;
+        SaveNanos                  = 0;
+        EpochIndex                 = 0;
+        EpochBase.clear();
+
+        // Without a %p in the path the child would overwrite the profile of
+        // its parent.
+        if (!hasPidPattern(GlobalProfileTemplate)) {
+            GlobalProfileTemplate += ".%p";
+        }
+        GlobalProfilePath = expandProfilePath(GlobalProfileTemplate);
+        if (Continuous.Map) {
+            mapContinuousCounters();
+        }
+
+        // The dump thread does not exist in the child, its handle can not be
+        // joined.
+        DumpThread.release();
+        DumpThreadStop = false;
+        ForkPending.store(false, memory_order_release);
+    }
+    startDumpThread();
+}
+
+/// Count a path of a heavy hitter function in the summary of the thread,
+/// allocating the summaries of the thread on first use.
+void logHeavyHitter(uint64_t Val, uint32_t H, ThreadNode *Node) {
+    SpaceSaving **Summaries = ThreadSummaries;
+    if (!Summaries) {
+        Summaries = new SpaceSaving *[GlobalHeavyHitters.size()]();
+        ThreadSummaries = Summaries;
+        Node->Summaries.store(Summaries, memory_order_release);
+        bumpStat(Node->Stats.BytesAllocated,
+                 GlobalHeavyHitters.size() * sizeof(SpaceSaving *));
+    }
+    if (!Summaries[H]) {
+        auto *S = new SpaceSaving(GlobalHeavyHitters[H].Capacity);
+        __atomic_store_n(&Summaries[H], S, __ATOMIC_RELEASE);
+        bumpStat(Node->Stats.BytesAllocated, sizeof(SpaceSaving) + S->bytes());
+    }
+    Summaries[H]->inc(Val);
+}
+
+extern "C" {
+
+// The number of functions is read from EPP(numberOfFunctions) instead, it is
+// also needed by the logging functions.
+void EPP(init)(uint32_t /*NumberOfFunctions*/, uint32_t Format, char *Path) {
+    const char *Output    = getenv("EPP_PROFILE_OUTPUT");
+    GlobalProfileFormat   = Format;
+    GlobalProfileTemplate = Output && *Output ? Output : Path;
+    GlobalProfilePath     = expandProfilePath(GlobalProfileTemplate);
+    pathTableRelease()    = releaseTableStorage;
+    ExitedPages.reset(new unique_ptr<PathTable[]>[numPages()]);
+    ExitedShard.reset(new uint64_t[EPP(shardWords)]());
+    PerThreadDump = getenv("EPP_PER_THREAD_DUMP") != nullptr;
+    StatsTrailer  = getenv("EPP_STATS") != nullptr;
+    ModuleLine    = getenv("EPP_MODULE_HASH") != nullptr;
+    EpochStart    = nowMillis();
+    if (const char *Enable = getenv("EPP_ENABLE")) {
+        __atomic_store_n(&EPP(enabled), atoi(Enable) != 0, __ATOMIC_RELAXED);
+    }
+    pthread_atfork(prepareFork, parentAfterFork, childAfterFork);
+    startDumpThread();
+}
+
+/// Enable sampling. The parameters compiled into the module can be
+/// overridden with EPP_SAMPLE_PERIOD and EPP_SAMPLE_BURST, a period of zero
+/// logs every path.
+void EPP(setSampling)(uint32_t Burst, uint32_t Period) {
+    if (const char *P = getenv("EPP_SAMPLE_PERIOD")) {
+        Period = atoi(P);
+    }
+    if (const char *B = getenv("EPP_SAMPLE_BURST")) {
+        Burst = atoi(B);
+    }
+    if (Period && (Burst == 0 || Burst > Period)) {
+        cerr << "epp: invalid sampling burst " << Burst << " for period "
+             << Period << ", logging every path\n";
+        Period = 0;
+    }
+    GlobalSampling.Burst  = Period ? Burst : 0;
+    GlobalSampling.Period = Period;
+}
+
+void EPP(setModuleHash)(uint64_t Hash) { GlobalModuleHash = Hash; }
+
+void EPP(registerArray)(uint32_t FunctionId, uint64_t *Counts,
+                        uint64_t NumPaths) {
+    lock_guard<mutex> lock(registerMutex);
+    GlobalArrayCounters.push_back({FunctionId, Counts, NumPaths});
+}
+
+void EPP(registerShardedArray)(uint32_t FunctionId, uint64_t Offset,
+                               uint64_t NumPaths) {
+    lock_guard<mutex> lock(registerMutex);
+    GlobalShardedCounters.push_back({FunctionId, Offset, NumPaths});
+}
+
+/// Map the continuous counter block of the module, which the instrumented
+/// code finds through \p Block. Called after every array mode function has
+/// been registered.
+void EPP(registerContinuous)(uint64_t **Block, uint64_t Words) {
+    lock_guard<mutex> lock(registerMutex);
+    Continuous.Block = Block;
+    Continuous.Words = Words;
+    mapContinuousCounters();
+}
+
+/// Count the paths of a function in a heavy hitter summary of the given
+/// capacity instead of a path table.
+void EPP(registerHeavyHitter)(uint32_t FunctionId, uint32_t Capacity) {
+    lock_guard<mutex> lock(registerMutex);
+    if (HeavyHitterIndex.empty()) {
+        HeavyHitterIndex.assign(EPP(numberOfFunctions), -1);
+    }
+    HeavyHitterIndex[FunctionId] = GlobalHeavyHitters.size();
+    GlobalHeavyHitters.push_back({FunctionId, max(Capacity, 1u)});
+    lock_guard<mutex> exited(ExitedSummariesMutex);
+    ExitedSummaries.resize(GlobalHeavyHitters.size());
+}
+
+uint64_t *EPP(shardInit)() {
+    size_t Bytes = (EPP(shardWords) * sizeof(uint64_t) + 63) & ~size_t(63);
+    void *Shard  = nullptr;
+    if (posix_memalign(&Shard, 64, Bytes ? Bytes : 64)) {
+        throw bad_alloc();
+    }
+    memset(Shard, 0, Bytes);
+    EPP(shard)       = static_cast<uint64_t *>(Shard);
+    ThreadNode *Node = currentNode();
+    Node->Shard.store(EPP(shard), memory_order_release);
+    bumpStat(Node->Stats.BytesAllocated, Bytes);
+    return EPP(shard);
+}
+
+/// Out of line part of the logging fast path. This registers the thread on
+/// the first call and handles path table insertion, growth and promotion.
+void EPP(logPathSlow)(uint64_t Val, uint64_t FunctionId) {
+    ThreadNode *Node = currentNode();
+    bumpStat(Node->Stats.SlowPathCalls, 1);
+    if (!HeavyHitterIndex.empty() && HeavyHitterIndex[FunctionId] >= 0) {
+        logHeavyHitter(Val, HeavyHitterIndex[FunctionId], Node);
+        return;
+    }
+    PathTable **Tables = EPP(tables);
+    if (!Tables) {
+        Tables = new PathTable *[numPages()];
+        fill(Tables, Tables + numPages(), static_cast<PathTable *>(EmptyPage));
+        EPP(tables) = Tables;
+        Node->Tables.store(Tables, memory_order_release);
+        bumpStat(Node->Stats.BytesAllocated, numPages() * sizeof(PathTable *));
+    }
+    PathTable *&Page = Tables[FunctionId >> PathTablePageBits];
+    if (Page == EmptyPage) {
+        __atomic_store_n(&Page, new PathTable[PathTablePageSize],
+                         __ATOMIC_RELEASE);
+        bumpStat(Node->Stats.BytesAllocated,
+                 PathTablePageSize * sizeof(PathTable));
+    }
+
+    PathTable &Table = lookupPathTable(Tables, FunctionId);
+    uint64_t Bytes   = Table.bytes();
+    Table.inc(Val);
+    if (Table.bytes() != Bytes) {
+        bumpStat(Node->Stats.TableResizes, Bytes != 0);
+        bumpStat(Node->Stats.BytesAllocated, Table.bytes());
+    }
+}
+
+void EPP(logPath)(uint64_t Val, uint64_t FunctionId) {
+    PathTable **Tables = EPP(tables);
+    if (!Tables || !lookupPathTable(Tables, FunctionId).tryInc(Val)) {
+        EPP(logPathSlow)(Val, FunctionId);
+    }
+}
+
+/// Log a path of a function instrumented with -timed-paths, which took
+/// \p Cycles cycles of the cycle counter from its start to its log site.
+void EPP(logPathTimed)(uint64_t Val, uint64_t FunctionId, uint64_t Cycles) {
+    EPP(logPath)(Val, FunctionId);
+
+    ThreadNode *Node = currentNode();
+    PathTimes *Times = ThreadTimes;
+    if (!Times) {
+        Times = ThreadTimes = new PathTimes();
+        Node->Times.store(Times, memory_order_release);
+        bumpStat(Node->Stats.BytesAllocated, sizeof(PathTimes));
+    }
+    uint64_t Bytes = Times->bytes();
+    Times->add(FunctionId, Val, Cycles);
+    if (Times->bytes() != Bytes) {
+        bumpStat(Node->Stats.TableResizes, Bytes != 0);
+        bumpStat(Node->Stats.BytesAllocated, Times->bytes());
+    }
+}
+
+/// Log a sampled path and rearm the countdown of the thread, either for the
+/// next path of the burst or for the first path of the next burst.
+void EPP(logPathSampled)(uint64_t Val, uint64_t FunctionId) {
+    EPP(logPath)(Val, FunctionId);
+
+    uint32_t Period = GlobalSampling.Period;
+    if (!Period) {
+        EPP(sampleCountdown) = 1;
+        return;
+    }
+    if (SampleBurstLeft == 0) {
+        SampleBurstLeft = GlobalSampling.Burst;
+    }
+    EPP(sampleCountdown) =
+        --SampleBurstLeft ? 1 : Period - GlobalSampling.Burst + 1;
+}
+
+/// Fill in the statistics of the runtime, see EPPRuntime.h.
+void EPP(getStats)(EPPStats *Stats) {
+    finishForkIfPending();
+    lock_guard<mutex> lock(SnapshotMutex);
+    vector<FunctionProfile> Profile;
+    takeSnapshot(Profile, Stats);
+}
+
+/// Turn profiling of -switchable functions on or off, see EPPRuntime.h.
+void EPP(enable)() { __atomic_store_n(&EPP(enabled), 1, __ATOMIC_RELAXED); }
+
+void EPP(disable)() { __atomic_store_n(&EPP(enabled), 0, __ATOMIC_RELAXED); }
+
+/// Close the current epoch, see EPPRuntime.h.
+void EPP(advanceEpoch)() {
+    finishForkIfPending();
+    lock_guard<mutex> lock(SnapshotMutex);
+    EpochsEnabled = true;
+    closeEpoch();
+}
+
+/// Report the path counts of a snapshot to \p Callback, see EPPRuntime.h.
+void EPP(snapshot)(EPPSnapshotCallback Callback, void *Context) {
+    finishForkIfPending();
+    vector<FunctionProfile> Profile;
+    {
+        lock_guard<mutex> lock(SnapshotMutex);
+        takeSnapshot(Profile);
+    }
+
+    for (auto &F : Profile) {
+        sortPaths(F, TextProfile);
+        for (size_t I = 0; I < F.Paths.size(); I++) {
+            uint64_t Error = F.approximate() ? F.Errors[I] : 0;
+            if (Callback(Context, F.FunctionId, F.Paths[I].first,
+                         F.Paths[I].second, Error)) {
+                return;
+            }
+        }
+    }
+}
+
+} // extern "C"
+
+// Entry point for log sites which use the preserve_most calling convention,
+// see the -preserve-most option of llvm-epp. The callee has to preserve all
+// general purpose registers except r11, so the thunk saves the caller saved
+// registers of the C calling convention around the call to EPP(logPath).
+// The arguments are passed in the same registers for both conventions.
+#if defined(__x86_64__) && defined(__ELF__)
+asm(R"(
+    .text
+    .globl  __epp_logPathPreserveMost
+    .type   __epp_logPathPreserveMost, @function
+    .p2align 4
+__epp_logPathPreserveMost:
+    .cfi_startproc
+    pushq   %rax
+    .cfi_adjust_cfa_offset 8
+    pushq   %rcx
+    .cfi_adjust_cfa_offset 8
+    pushq   %rdx
+    .cfi_adjust_cfa_offset 8
+    pushq   %rsi
+    .cfi_adjust_cfa_offset 8
+    pushq   %rdi
+    .cfi_adjust_cfa_offset 8
+    pushq   %r8
+    .cfi_adjust_cfa_offset 8
+    pushq   %r9
+    .cfi_adjust_cfa_offset 8
+    pushq   %r10
+    .cfi_adjust_cfa_offset 8
+    subq    $8, %rsp
+    .cfi_adjust_cfa_offset 8
+    call    __epp_logPath@PLT
+    addq    $8, %rsp
+    .cfi_adjust_cfa_offset -8
+    popq    %r10
+    .cfi_adjust_cfa_offset -8
+    popq    %r9
+    .cfi_adjust_cfa_offset -8
+    popq    %r8
+    .cfi_adjust_cfa_offset -8
+    popq    %rdi
+    .cfi_adjust_cfa_offset -8
+    popq    %rsi
+    .cfi_adjust_cfa_offset -8
+    popq    %rdx
+    .cfi_adjust_cfa_offset -8
+    popq    %rcx
+    .cfi_adjust_cfa_offset -8
+    popq    %rax
+    .cfi_adjust_cfa_offset -8
+    ret
+    .cfi_endproc
+    .size   __epp_logPathPreserveMost, .-__epp_logPathPreserveMost
+)");
+#endif
+
+extern "C" {
+
+/// Write the profile at exit. \p path is the path compiled into the
+/// module, the expanded path chosen by EPP(init) takes precedence.
+void EPP(save)(char *path) {
+    finishForkIfPending();
+    stopDumpThread();
+    writeProfile(GlobalProfilePath.empty() ? path : GlobalProfilePath.c_str());
+    if (EpochsEnabled) {
+        lock_guard<mutex> lock(SnapshotMutex);
+        closeEpoch();
+    }
+
+    // Threads which exited have written their own profile already. The
+    // others may still be running, their tables are read like a snapshot
+    // and the files written once exiting threads are let go again.
+    if (PerThreadDump) {
+        lock_guard<mutex> lock(SnapshotMutex);
+        vector<pair<uint32_t, vector<FunctionProfile>>> Profiles;
+        {
+            SnapshotRegion Region;
+            for (ThreadNode *N = ThreadList.load(memory_order_acquire); N;
+                 N = N->Next) {
+                if (N->InUse.load(memory_order_acquire)) {
+                    Profiles.emplace_back(N->Index,
+                                          vector<FunctionProfile>());
+                    collectThreadProfile(N, Profiles.back().second);
+                }
+            }
+        }
+        for (auto &P : Profiles) {
+            writeProfileFile(threadProfilePath(P.first), P.second);
+        }
+    }
 }
 }
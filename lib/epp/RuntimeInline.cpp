@@ -0,0 +1,29 @@
+// The logging fast path of the runtime. This file is compiled to bitcode
+// and linked into the instrumented module by llvm-epp (see -runtime-bc)
+// so that each log site is inlined as a probe of the thread's path table.
+// Only the first execution of a path on a thread, table growth and count
+// promotion leave the inlined code through __epp_logPathSlow.
+
+#include <cstdint>
+
+#include "PathTable.h"
+
+#define EPP(X) __epp_##X
+
+using namespace epp;
+
+extern "C" {
+
+extern __thread PathTable **EPP(tables)
+    __attribute__((tls_model("initial-exec")));
+
+void EPP(logPathSlow)(uint64_t Val, uint64_t FunctionId);
+
+void EPP(logPathInline)(uint64_t Val, uint64_t FunctionId) {
+    PathTable **Tables = EPP(tables);
+    if (__builtin_expect(
+            !Tables || !lookupPathTable(Tables, FunctionId).tryInc(Val), 0)) {
+        EPP(logPathSlow)(Val, FunctionId);
+    }
+}
+}
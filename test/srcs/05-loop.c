@@ -9,7 +9,21 @@ int main(int argc, char* argv[]) {
 // RUN: clang -c -g -emit-llvm %s -o %t.1.bc 
 // RUN: opt -instnamer %t.1.bc -o %t.bc
 // RUN: llvm-epp %t.bc -o %t.profile
+// RUN: llvm-dis %t.epp.bc -o %t.ll
+// RUN: grep -E -q '= phi i64 \[ -?[0-9]+, %[^ ]+ \], \[ -?[0-9]+, %[^ ]+ \]' %t.ll
+// RUN: awk '/^for\.inc\.intp:/ { exit 1 }' %t.ll
+// RUN: awk '/%epp\.ctr = alloca/ { exit 1 }' %t.ll
 // RUN: clang -v %t.epp.bc -o %t-exec -lepp-rt 2> %t.compile 
 // RUN: %t-exec > %t.log
 // RUN: llvm-epp -p=%t.profile %t.bc 2> %t.decode
 // RUN: diff -aub %t.profile %s.txt
+// RUN: llvm-epp -array-threshold=64 %t.bc -o %t.array.profile
+// RUN: llvm-dis %t.epp.bc -o %t.array.ll
+// RUN: grep -q '^@__epp_counters.main = internal global \[[0-9]* x i64\] zeroinitializer' %t.array.ll
+// RUN: grep -q '%epp.cnt.ptr = getelementptr inbounds \[[0-9]* x i64\], .*@__epp_counters.main, i64 0' %t.array.ll
+// RUN: grep -q '%epp.cnt.inc = add i64 %ld.epp.cnt, 1' %t.array.ll
+// RUN: awk '/call void @__epp_logPath\(/ { exit 1 }' %t.array.ll
+// RUN: clang -v %t.epp.bc -o %t-array-exec -lepp-rt 2> %t.compile
+// RUN: %t-array-exec > %t.log
+// RUN: llvm-epp -p=%t.array.profile %t.bc 2> %t.decode
+// RUN: diff -aub %t.array.profile %s.txt
@@ -28,3 +28,12 @@ int main(int argc, char* argv[]) {
 // RUN: %t-exec > %t.log
 // RUN: llvm-epp -p=%t.profile %t.bc 2> %t.decode
 // RUN: diff -aub %t.profile %s.txt
+// RUN: llvm-epp -array-threshold=64 -counter-mode=atomic %t.bc -o %t.atomic.profile
+// RUN: llvm-dis %t.epp.bc -o %t.atomic.ll
+// RUN: grep -q '^@__epp_counters.foo = internal global' %t.atomic.ll
+// RUN: grep -q 'atomicrmw add .*%epp.cnt.ptr, i64 1 monotonic' %t.atomic.ll
+// RUN: awk '/call void @__epp_logPath\(|%epp.cnt.inc = / { exit 1 }' %t.atomic.ll
+// RUN: clang -v %t.epp.bc -o %t-atomic-exec -lepp-rt -lpthread 2> %t.compile
+// RUN: %t-atomic-exec > %t.log
+// RUN: llvm-epp -p=%t.atomic.profile %t.bc 2> %t.decode
+// RUN: diff -aub %t.atomic.profile %s.txt
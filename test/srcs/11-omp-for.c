@@ -21,3 +21,14 @@ int main()
 // RUN: OMP_NUM_THREADS=4 %t-exec > %t.log
 // RUN: llvm-epp -p=%t.profile %t.bc 2> %t.decode
 // RUN: diff -aub %t.profile %s.txt
+// RUN: llvm-epp -array-threshold=64 -counter-mode=sharded %t.bc -o %t.sharded.profile
+// RUN: llvm-dis %t.epp.bc -o %t.sharded.ll
+// RUN: grep -q '^@__epp_shard = .*thread_local' %t.sharded.ll
+// RUN: grep -q '%epp.shard.init = call .*@__epp_shardInit()' %t.sharded.ll
+// RUN: grep -q '%epp.cnt.ptr = getelementptr inbounds i64, .*%epp.shard, i64 ' %t.sharded.ll
+// RUN: grep -q '%epp.cnt.inc = add i64 %ld.epp.cnt, 1' %t.sharded.ll
+// RUN: awk '/call void @__epp_logPath\(|atomicrmw/ { exit 1 }' %t.sharded.ll
+// RUN: clang -fopenmp -v %t.epp.bc -o %t-sharded-exec -lepp-rt -lpthread -lm 2> %t.compile
+// RUN: OMP_NUM_THREADS=4 %t-sharded-exec > %t.log
+// RUN: llvm-epp -p=%t.sharded.profile %t.bc 2> %t.decode
+// RUN: diff -aub %t.sharded.profile %s.txt
@@ -23,4 +23,94 @@ int main(int argc, char* argv[]) {
 // RUN: clang -v %t.epp.bc -o %t-exec -lepp-rt 2> %t.compile 
 // RUN: %t-exec 1 2 3 > %t.log
 // RUN: llvm-epp -p=%t.profile %t.bc 2> %t.decode
+// RUN: grep -q '^# Dynamic Increments' %t.decode
 // RUN: diff -aub %t.profile %s.txt
+// RUN: llvm-epp -runtime-bc=%epplibdir/epp-rt-inline.bc %t.bc -o %t.inline.profile
+// RUN: llvm-dis %t.epp.bc -o %t.inline.ll
+// RUN: grep -q '^@__epp_tables = .*thread_local' %t.inline.ll
+// RUN: grep -q 'call void @__epp_logPathSlow(' %t.inline.ll
+// RUN: awk '/call void @__epp_logPath(Inline)?\(/ { exit 1 }' %t.inline.ll
+// RUN: clang -v %t.epp.bc -o %t-inline-exec -lepp-rt 2> %t.compile
+// RUN: %t-inline-exec 1 2 3 > %t.log
+// RUN: llvm-epp -p=%t.inline.profile %t.bc 2> %t.decode
+// RUN: diff -aub %t.inline.profile %s.txt
+// RUN: llvm-epp -preserve-most %t.bc -o %t.pm.profile
+// RUN: llvm-dis %t.epp.bc -o %t.pm.ll
+// RUN: grep -q 'call preserve_mostcc void @__epp_logPathPreserveMost(' %t.pm.ll
+// RUN: awk '/call void @__epp_logPath\(/ { exit 1 }' %t.pm.ll
+// RUN: clang -v %t.epp.bc -o %t-pm-exec -lepp-rt 2> %t.compile
+// RUN: %t-pm-exec 1 2 3 > %t.log
+// RUN: llvm-epp -p=%t.pm.profile %t.bc 2> %t.decode
+// RUN: diff -aub %t.pm.profile %s.txt
+// RUN: llvm-epp -profile-format=binary %t.bc -o %t.bin.profile
+// RUN: clang -v %t.epp.bc -o %t-bin-exec -lepp-rt 2> %t.compile
+// RUN: %t-bin-exec 1 2 3 > %t.log
+// RUN: llvm-epp -p=%t.bin.profile %t.bc 2> %t.decode
+// RUN: llvm-epp -p=%t.bin.profile -export-text=%t.bin.txt %t.bc
+// RUN: grep -v '^# module' %t.bin.txt | diff -aub - %s.txt
+// RUN: llvm-epp -sample-period=5 -sample-burst=1 %t.bc -o %t.sampled.profile
+// RUN: clang -v %t.epp.bc -o %t-sampled-exec -lepp-rt 2> %t.compile
+// RUN: %t-sampled-exec 1 2 3 > %t.log
+// RUN: llvm-epp -p=%t.sampled.profile %t.bc 2> %t.sampled.decode
+// RUN: grep -qx '# sampling 1 5' %t.sampled.profile
+// RUN: grep -v '^#' %t.sampled.profile | awk 'length($1) == 16 { s += $2 } END { print s }' | grep -qx 5
+// RUN: grep 'est_freq:' %t.sampled.decode | awk '{ s += $2 } END { print s }' | grep -qx 25
+// RUN: llvm-epp -heavy-hitters=main -heavy-hitter-capacity=4 %t.bc -o %t.hh.profile
+// RUN: clang -v %t.epp.bc -o %t-hh-exec -lepp-rt 2> %t.compile
+// RUN: %t-hh-exec 1 2 3 > %t.log
+// RUN: llvm-epp -p=%t.hh.profile %t.bc 2> %t.hh.decode
+// RUN: grep -q '^0 4 approximate [1-9]' %t.hh.profile
+// RUN: grep -v '^#' %t.hh.profile | awk 'length($1) == 16 && $3 > 0' | grep -q .
+// RUN: grep -v '^#' %t.hh.profile | awk 'length($1) == 16 && $3 > $2 { exit 1 }'
+// RUN: grep -q '^    error: [1-9]' %t.hh.decode
+// RUN: grep -v '^#' %t.hh.profile | awk 'length($1) == 16 { s += $2 } END { print s }' | grep -qx 25
+// RUN: env EPP_STATS=1 EPP_PROFILE_OUTPUT=%t.stats.profile %t-exec 1 2 3 > %t.log
+// RUN: grep -v '^# stats' %t.stats.profile | diff -aub - %s.txt
+// RUN: grep -q '^# stats log_calls 25$' %t.stats.profile
+// RUN: grep -q '^# stats distinct_paths 11$' %t.stats.profile
+// RUN: rm -f %t.profile %t.env.profile
+// RUN: env EPP_PROFILE_OUTPUT=%t.env.profile %t-exec 1 2 3 > %t.log
+// RUN: test ! -e %t.profile
+// RUN: llvm-epp -p=%t.env.profile %t.bc 2> %t.decode
+// RUN: diff -aub %t.env.profile %s.txt
+// RUN: env EPP_MODULE_HASH=1 EPP_PROFILE_OUTPUT=%t.m1.profile %t-exec 1 2 3 > %t.log
+// RUN: env EPP_MODULE_HASH=1 EPP_PROFILE_OUTPUT=%t.m2.profile %t-exec 1 2 3 > %t.log
+// RUN: llvm-epp merge %t.m1.profile -weighted-input=2,%t.m2.profile -j 2 -o %t.merged
+// RUN: grep -q '^# module' %t.merged
+// RUN: llvm-epp -p=%t.merged %t.bc 2> %t.decode
+// RUN: awk 'length($1) == 16 { print $1, $2 * 3; next } { print }' %s.txt > %t.three
+// RUN: grep -v '^# module' %t.merged | diff -aub - %t.three
+// RUN: sed 's/^# module .*/# module 0000000000000001/' %t.m1.profile > %t.other.profile
+// RUN: rm -f %t.rejected
+// RUN: llvm-epp merge %t.m1.profile %t.other.profile -o %t.rejected 2> %t.err || true
+// RUN: grep -q 'was not profiled from the same module' %t.err
+// RUN: test ! -e %t.rejected
+// RUN: llvm-epp merge -profile-format=binary %t.m1.profile -o %t.bin
+// RUN: head -c 7 %t.bin | grep -q EPPPROF
+// RUN: llvm-epp merge %t.m1.profile %t.bin -o %t.mixed
+// RUN: llvm-epp merge -weighted-input=2,%t.m1.profile -o %t.twice
+// RUN: diff -aub %t.twice %t.mixed
+// RUN: llvm-epp merge -weighted-input=3,%t.m1.profile -o %t.thrice
+// RUN: llvm-epp merge -normalize %t.m1.profile -weighted-input=2,%t.thrice -o %t.normalized
+// RUN: grep -v '^#' %t.m1.profile | awk 'length($1) == 16 { print $1, $2 * 6; next } { print }' > %t.six
+// RUN: grep -v '^#' %t.normalized | diff -aub - %t.six
+// RUN: llvm-epp -timed-paths %t.bc -o %t.timed.profile
+// RUN: llvm-dis %t.epp.bc -o %t.timed.ll
+// RUN: awk '/%epp\.(ctr|start) = alloca/ { exit 1 }' %t.timed.ll
+// RUN: clang -v %t.epp.bc -o %t-timed-exec -lepp-rt 2> %t.compile
+// RUN: %t-timed-exec 1 2 3 > %t.log
+// RUN: llvm-epp -p=%t.timed.profile %t.bc 2> %t.timed.decode
+// RUN: grep -q '^# Hot Paths' %t.timed.decode
+// RUN: grep -v '^#' %t.timed.profile | cut -d' ' -f1,2 | diff -aub - %s.txt
+// RUN: llvm-epp -switchable %t.bc -o %t.switch.profile
+// RUN: clang -v %t.epp.bc -o %t-switch-exec -lepp-rt 2> %t.compile
+// RUN: env EPP_PROFILE_OUTPUT=%t.off.profile %t-switch-exec 1 2 3 > %t.log
+// RUN: sed '/^#/d' %t.off.profile > %t.off
+// RUN: test ! -s %t.off
+// RUN: env EPP_ENABLE=1 %t-switch-exec 1 2 3 > %t.log
+// RUN: llvm-epp -p=%t.switch.profile %t.bc 2> %t.decode
+// RUN: diff -aub %t.switch.profile %s.txt
+// RUN: llvm-epp -event-counting=false %t.bc -o %t.edges.profile
+// RUN: clang -v %t.epp.bc -o %t-edges-exec -lepp-rt 2> %t.compile
+// RUN: %t-edges-exec 1 2 3 > %t.log
+// RUN: diff -aub %t.edges.profile %s.txt
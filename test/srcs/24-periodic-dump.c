@@ -0,0 +1,57 @@
+#include <signal.h>
+#include <stdio.h>
+#include <unistd.h>
+
+int take_dump(const char *path, const char *suffix, int tries);
+void signal_dump(const char *path);
+
+int main(int argc, char* argv[]) { 
+    if(argc > 2) {
+        for(int i = 0; i < 10; i++) {
+            if(i%2) {
+                printf("This is a loop");
+            }
+        }
+    } 
+
+    take_dump(argv[1], "periodic", 500);
+    for(int i = 0; i < 10; i++) {
+        if(i%3) {
+            printf("This is another loop");
+        }
+    }
+    
+    signal_dump(argv[1]);
+    return 0;
+}
+
+// Wait up to tries * 10ms for a dump of the profile and move it out of the
+// way of the next one.
+int take_dump(const char *path, const char *suffix, int tries) {
+    char copy[4096];
+    snprintf(copy, sizeof(copy), "%s.%s", path, suffix);
+    while (tries-- > 0) {
+        if (rename(path, copy) == 0) {
+            return 1;
+        }
+        usleep(10000);
+    }
+    return 0;
+}
+
+// The periodic dump was just taken, the next one is a second away.
+void signal_dump(const char *path) {
+    raise(SIGUSR1);
+    take_dump(path, "signal", 50);
+}
+
+// RUN: clang -c -g -emit-llvm %s -o %t.1.bc 
+// RUN: opt -instnamer %t.1.bc -o %t.bc
+// RUN: llvm-epp %t.bc -o %t.profile
+// RUN: clang -v %t.epp.bc -o %t-exec -lepp-rt 2> %t.compile 
+// RUN: rm -f %t.profile %t.profile.periodic %t.profile.signal
+// RUN: env EPP_DUMP_INTERVAL=1 EPP_DUMP_SIGNAL=USR1 %t-exec %t.profile 2 3 > %t.log
+// RUN: awk 'length($1) != 16 { f = $1 } f == "0" && length($1) == 16 && $2 > 1 { s = s ? s " " $2 : $2 } END { print s }' %t.profile.periodic | grep -qx '5 4'
+// RUN: awk 'length($1) != 16 { f = $1 } f == "0" && length($1) == 16 && $2 > 1 { s = s ? s " " $2 : $2 } END { print s }' %t.profile.signal | grep -qx '6 5 4 3'
+// RUN: llvm-epp -p=%t.profile %t.bc 2> %t.decode
+// RUN: grep -v '^#' %t.profile | awk 'length($1) != 16 { f = $1 } f == "0"' | diff -aub - %S/14-triangle-loop.c.txt
@@ -0,0 +1,35 @@
+#include <pthread.h>
+#include <stdio.h>
+
+void *worker(void *arg) {
+    for(int i = 0; i < 10; i++) {
+        if(i%3) {
+            printf("This is a loop");
+        }
+    }
+    return NULL;
+}
+
+// The workers run one after the other and are numbered 0 and 1, main logs
+// its only path last and is numbered 2.
+int main(int argc, char* argv[]) {
+    pthread_t thread;
+    pthread_create(&thread, NULL, worker, NULL);
+    pthread_join(thread, NULL);
+    pthread_create(&thread, NULL, worker, NULL);
+    pthread_join(thread, NULL);
+    return 0;
+}
+
+// RUN: clang -c -g -emit-llvm %s -o %t.1.bc 
+// RUN: opt -instnamer %t.1.bc -o %t.bc
+// RUN: llvm-epp %t.bc -o %t.profile
+// RUN: clang -v %t.epp.bc -o %t-exec -lepp-rt -lpthread 2> %t.compile 
+// RUN: rm -f %t.profile %t.profile.*
+// RUN: env EPP_PER_THREAD_DUMP=1 EPP_MERGE_THREADS=2 %t-exec > %t.log
+// RUN: llvm-epp -p=%t.profile %t.bc 2> %t.decode
+// RUN: llvm-epp -p=%t.profile.0 %t.bc 2> %t.decode.0
+// RUN: diff -aub %t.profile.1 %t.profile.0
+// RUN: cat %t.profile.0 %t.profile.1 %t.profile.2 | grep -v '^#' | awk 'length($1) == 16 { s += $2 } END { print s }' > %t.threads
+// RUN: grep -v '^#' %t.profile | awk 'length($1) == 16 { s += $2 } END { print s }' | diff -aub - %t.threads
+// RUN: ls %t.profile.* | sed 's/.*\.//' | diff -aub - %s.txt
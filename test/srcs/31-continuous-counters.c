@@ -0,0 +1,39 @@
+#include <signal.h>
+#include <stdio.h>
+#include <unistd.h>
+
+void crash(void);
+
+int main(int argc, char* argv[]) { 
+    if(argc > 2) {
+        for(int i = 0; i < 10; i++) {
+            if(i%2) {
+                printf("This is a loop");
+            }
+        }
+    } 
+
+    crash();
+    for(int i = 0; i < 10; i++) {
+        if(i%3) {
+            printf("This is another loop");
+        }
+    }
+    
+    return 0;
+}
+
+// Killed between the loops, the profile is never saved. The counts of the
+// first loop must still be found in the counters file.
+void crash(void) { kill(getpid(), SIGKILL); }
+
+// RUN: clang -c -g -emit-llvm %s -o %t.1.bc 
+// RUN: opt -instnamer %t.1.bc -o %t.bc
+// RUN: llvm-epp -array-threshold=64 -continuous-counters %t.bc -o %t.profile
+// RUN: clang -v %t.epp.bc -o %t-exec -lepp-rt 2> %t.compile 
+// RUN: rm -f %t.profile %t.profile.counters
+// RUN: %t-exec 1 2 3 > %t.log || true
+// RUN: test ! -e %t.profile
+// RUN: llvm-epp -p=%t.profile.counters %t.bc 2> %t.decode
+// RUN: llvm-epp -p=%t.profile.counters -export-text=%t.txt %t.bc
+// RUN: grep -v '^#' %t.txt | awk 'length($1) == 16 && $2 > 1' | diff -aub - %s.txt
@@ -0,0 +1,35 @@
+#include <stdio.h>
+
+void __epp_advanceEpoch(void);
+
+int main(int argc, char* argv[]) { 
+    if(argc > 2) {
+        for(int i = 0; i < 10; i++) {
+            if(i%2) {
+                printf("This is a loop");
+            }
+        }
+    } 
+
+    __epp_advanceEpoch();
+    for(int i = 0; i < 10; i++) {
+        if(i%3) {
+            printf("This is another loop");
+        }
+    }
+    
+    return 0;
+}
+
+// RUN: clang -c -g -emit-llvm %s -o %t.1.bc 
+// RUN: opt -instnamer %t.1.bc -o %t.bc
+// RUN: llvm-epp %t.bc -o %t.profile
+// RUN: clang -v %t.epp.bc -o %t-exec -lepp-rt 2> %t.compile 
+// RUN: rm -f %t.profile.epochs
+// RUN: env EPP_EPOCH_INTERVAL=60 %t-exec 1 2 3 > %t.log
+// RUN: grep -q '^# epoch 0 ' %t.profile.epochs
+// RUN: grep -q '^# epoch 1 ' %t.profile.epochs
+// RUN: grep -v '^#' %t.profile.epochs | awk 'length($1) == 16 { s += $2 } END { print s }' | grep -qx 25
+// RUN: awk '/^# epoch / { e = $3 } length($1) == 16 && $2 > 1 { print e, $0 }' %t.profile.epochs | diff -aub - %s.txt
+// RUN: llvm-epp -p=%t.profile.epochs %t.bc 2> %t.decode
+// RUN: grep -q '^# Path Time Series' %t.decode
@@ -0,0 +1,47 @@
+#include <stdio.h>
+
+int shared(int q, int p, int a);
+
+int main(int argc, char* argv[]) {
+    int s = 0;
+    for (int i = 0; i < 12; i++) {
+        switch (i % 4) {
+        case 0:
+        case 1:
+            continue;
+        case 2:
+            s += 2;
+            break;
+        default:
+            s += 3;
+        }
+    }
+    s += shared(argc > 1, argc > 2, argc);
+    printf("%d\n", s);
+    return 0;
+}
+
+// Both arms of the conditional branch to the same two blocks, so without
+// event counting the edges into the join carry the same increment of a
+// counter which is not constant there and share one block.
+int shared(int q, int p, int a) {
+    int s = 0;
+    if (q)
+        s++;
+    if (p ? a > 1 : a > 2)
+        s += 2;
+    return s;
+}
+
+// RUN: clang -c -g -emit-llvm %s -o %t.1.bc 
+// RUN: opt -instnamer %t.1.bc -o %t.bc
+// RUN: llvm-epp %t.bc -o %t.profile 2> %t.inst
+// RUN: clang -v %t.epp.bc -o %t-exec -lepp-rt 2> %t.compile 
+// RUN: %t-exec 1 2 3 > %t.log
+// RUN: llvm-epp -p=%t.profile %t.bc 2> %t.decode
+// RUN: grep -v '^#' %t.profile | awk 'length($1) == 16 { s += $2 } END { print s }' | diff -aub - %s.txt
+// RUN: llvm-epp -event-counting=false %t.bc -o %t.edges.profile 2> %t.edges.inst
+// RUN: grep -q 'num_merged_blocks: [1-9]' %t.edges.inst
+// RUN: clang -v %t.epp.bc -o %t-edges-exec -lepp-rt 2> %t.compile 
+// RUN: %t-edges-exec 1 2 3 > %t.log
+// RUN: grep -v '^#' %t.edges.profile | awk 'length($1) == 16 { s += $2 } END { print s }' | diff -aub - %s.txt
@@ -0,0 +1,53 @@
+#include <stdio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+void fork_child(void);
+
+int main(int argc, char* argv[]) { 
+    if(argc > 2) {
+        for(int i = 0; i < 10; i++) {
+            if(i%2) {
+                printf("This is a loop");
+            }
+        }
+    } 
+
+    for(int i = 0; i < 10; i++) {
+        if(i%3) {
+            printf("This is another loop");
+        }
+    }
+    
+    fork_child();
+    return 0;
+}
+
+void hit(void) {}
+
+// The child starts with an empty profile: it only counts the three calls
+// to hit, its own path through fork_child and the exit path of main.
+void fork_child(void) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        hit();
+        hit();
+        hit();
+        return;
+    }
+    waitpid(pid, NULL, 0);
+    fprintf(stderr, "%d\n", pid);
+}
+
+// RUN: clang -c -g -emit-llvm %s -o %t.1.bc 
+// RUN: opt -instnamer %t.1.bc -o %t.bc
+// RUN: llvm-epp %t.bc -o %t.profile
+// RUN: clang -v %t.epp.bc -o %t-exec -lepp-rt 2> %t.compile 
+// RUN: rm -f %t.profile %t.profile.*
+// RUN: %t-exec 1 2 3 > %t.log 2> %t.pid
+// RUN: test -s %t.profile.`cat %t.pid`
+// RUN: grep -v '^#' %t.profile.`cat %t.pid` | awk 'length($1) == 16 { s += $2 } END { print s }' | grep -qx 5
+// RUN: grep -v '^#' %t.profile | awk 'length($1) == 16 { s += $2 } END { print s }' | grep -qx 26
+// RUN: llvm-epp -p=%t.profile %t.bc 2> %t.decode
+// RUN: grep -v '^#' %t.profile | awk 'length($1) != 16 { f = $1 } f == "0"' | diff -aub - %S/14-triangle-loop.c.txt
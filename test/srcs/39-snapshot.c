@@ -0,0 +1,51 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+typedef int (*EPPSnapshotCallback)(void *, uint32_t, uint64_t, uint64_t,
+                                   uint64_t);
+void __epp_snapshot(EPPSnapshotCallback Callback, void *Context);
+
+int print_path(void *context, uint32_t function, uint64_t path,
+               uint64_t count, uint64_t error);
+
+int main(int argc, char* argv[]) { 
+    if(argc > 2) {
+        for(int i = 0; i < 10; i++) {
+            if(i%2) {
+                printf("This is a loop");
+            }
+        }
+    } 
+
+    __epp_snapshot(print_path, "first");
+    for(int i = 0; i < 10; i++) {
+        if(i%3) {
+            printf("This is another loop");
+        }
+    }
+    
+    __epp_snapshot(print_path, "second");
+    __epp_snapshot(print_path, "stop");
+    return 0;
+}
+
+// Print each path of the snapshot, the one labelled stop ends after the
+// first path.
+int print_path(void *context, uint32_t function, uint64_t path,
+               uint64_t count, uint64_t error) {
+    fprintf(stderr, "%s %u %016llx %llu %llu\n", (const char *)context,
+            function, (unsigned long long)path, (unsigned long long)count,
+            (unsigned long long)error);
+    return strcmp(context, "stop") == 0;
+}
+
+// RUN: clang -c -g -emit-llvm %s -o %t.1.bc 
+// RUN: opt -instnamer %t.1.bc -o %t.bc
+// RUN: llvm-epp %t.bc -o %t.profile
+// RUN: clang -v %t.epp.bc -o %t-exec -lepp-rt 2> %t.compile 
+// RUN: %t-exec 1 2 3 > %t.log 2> %t.snapshot
+// RUN: awk '$1 != "stop" && $2 == 0 && $4 > 1' %t.snapshot | diff -aub - %s.txt
+// RUN: awk '$5 != 0 { exit 1 }' %t.snapshot
+// RUN: grep '^stop ' %t.snapshot | grep -qx 'stop 0 0000000000000005 6 0'
+// RUN: llvm-epp -p=%t.profile %t.bc 2> %t.decode
@@ -36,6 +36,7 @@
 #include "llvm/Support/ToolOutputFile.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Target/TargetMachine.h"
+#include "llvm/Transforms/IPO/AlwaysInliner.h"
 #include "llvm/Transforms/Scalar.h"
 
 #include "llvm/Analysis/LoopInfo.h"
@@ -48,6 +49,8 @@
 #include "BreakSelfLoopsPass.h"
 #include "EPPPathPrinter.h"
 #include "EPPProfile.h"
+#include "EPPProfileFormat.h"
+#include "EPPProfileMerge.h"
 #include "SplitLandingPadPredsPass.h"
 
 using namespace std;
@@ -82,6 +85,157 @@ cl::opt<bool> dumpGraphs("d",
                          cl::value_desc("toggle"), cl::Hidden, cl::init(false),
                          cl::cat(LLVMEppOptionCategory));
 
+cl::opt<unsigned> arrayThreshold(
+    "array-threshold",
+    cl::desc("Count the paths of functions with fewer than this many paths "
+             "in a static array instead of the runtime hash table"),
+    cl::value_desc("paths"), cl::init(0), cl::cat(LLVMEppOptionCategory));
+
+cl::opt<CounterMode> counterMode(
+    "counter-mode", cl::desc("How array mode counters are updated"),
+    cl::values(clEnumValN(Plain, "plain", "Non atomic shared counters"),
+               clEnumValN(Atomic, "atomic", "Relaxed atomic shared counters"),
+               clEnumValN(Sharded, "sharded",
+                          "Per thread counters reduced at dump time")),
+    cl::init(Plain), cl::cat(LLVMEppOptionCategory));
+
+cl::list<string> atomicCounters(
+    "atomic-counters",
+    cl::desc("Functions whose array counters use relaxed atomics"),
+    cl::value_desc("function"), cl::CommaSeparated,
+    cl::cat(LLVMEppOptionCategory));
+
+cl::list<string> shardedCounters(
+    "sharded-counters",
+    cl::desc("Functions whose array counters are sharded per thread"),
+    cl::value_desc("function"), cl::CommaSeparated,
+    cl::cat(LLVMEppOptionCategory));
+
+cl::opt<bool> continuousCounters(
+    "continuous-counters",
+    cl::desc("Keep the counters of array mode functions in a shared mapping "
+             "of <profile>.counters, which survives a crash"),
+    cl::value_desc("toggle"), cl::init(false), cl::cat(LLVMEppOptionCategory));
+
+cl::opt<string> runtimeBitcode(
+    "runtime-bc",
+    cl::desc("Link the runtime fast path (epp-rt-inline.bc) into the "
+             "instrumented module and inline it at each log site"),
+    cl::value_desc("filename"), cl::cat(LLVMEppOptionCategory));
+
+cl::opt<bool> preserveMost(
+    "preserve-most",
+    cl::desc("Call the runtime with the preserve_most calling convention "
+             "(x86-64 only)"),
+    cl::value_desc("toggle"), cl::init(false), cl::cat(LLVMEppOptionCategory));
+
+cl::opt<ProfileFormat> profileFormat(
+    "profile-format", cl::desc("Format of the profile written by the runtime"),
+    cl::values(clEnumValN(TextProfile, "text", "Human readable text"),
+               clEnumValN(BinaryProfile, "binary",
+                          "Compact binary, mapped into memory when read")),
+    cl::init(TextProfile), cl::cat(LLVMEppOptionCategory));
+
+cl::opt<unsigned> samplePeriod(
+    "sample-period",
+    cl::desc("Log bursts of -sample-burst paths out of every N paths "
+             "executed by a thread, 0 logs every path"),
+    cl::value_desc("N"), cl::init(0), cl::cat(LLVMEppOptionCategory));
+
+cl::opt<unsigned> sampleBurst("sample-burst",
+                              cl::desc("Number of paths logged in a burst"),
+                              cl::value_desc("K"), cl::init(1),
+                              cl::cat(LLVMEppOptionCategory));
+
+cl::list<string> heavyHitters(
+    "heavy-hitters",
+    cl::desc("Functions whose paths are counted approximately in a "
+             "bounded heavy hitter summary"),
+    cl::value_desc("function"), cl::CommaSeparated,
+    cl::cat(LLVMEppOptionCategory));
+
+cl::opt<unsigned> heavyHitterPaths(
+    "heavy-hitter-paths",
+    cl::desc("Count the paths of functions with at least this many paths "
+             "in a heavy hitter summary, 0 disables"),
+    cl::value_desc("paths"), cl::init(0), cl::cat(LLVMEppOptionCategory));
+
+cl::opt<unsigned> heavyHitterCapacity(
+    "heavy-hitter-capacity",
+    cl::desc("Number of paths kept by the heavy hitter summary of a "
+             "function on each thread"),
+    cl::value_desc("K"), cl::init(256), cl::cat(LLVMEppOptionCategory));
+
+cl::opt<bool> timedPaths(
+    "timed-paths",
+    cl::desc("Read the cycle counter at the start and end of each path and "
+             "record the total and longest time of every path"),
+    cl::value_desc("toggle"), cl::init(false), cl::cat(LLVMEppOptionCategory));
+
+cl::opt<bool> switchable(
+    "switchable",
+    cl::desc("Keep an uninstrumented copy of each function, run while "
+             "profiling is turned off with __epp_disable"),
+    cl::value_desc("toggle"), cl::init(false), cl::cat(LLVMEppOptionCategory));
+
+cl::opt<bool> eventCounting(
+    "event-counting",
+    cl::desc("Increment the path counter only on the chords of a spanning "
+             "tree of the hottest edges"),
+    cl::value_desc("toggle"), cl::init(true), cl::cat(LLVMEppOptionCategory));
+
+cl::opt<string> exportText(
+    "export-text",
+    cl::desc("Convert the profile given with -p to the text format"),
+    cl::value_desc("filename"), cl::cat(LLVMEppOptionCategory));
+
+cl::opt<unsigned> epochTopPaths(
+    "epoch-top",
+    cl::desc("Number of paths listed for each epoch when -p is given an "
+             "epochs file"),
+    cl::value_desc("N"), cl::init(5), cl::cat(LLVMEppOptionCategory));
+
+cl::opt<unsigned> hotPaths(
+    "hot-paths",
+    cl::desc("Number of paths ranked by cycles when -p is given a timed "
+             "profile"),
+    cl::value_desc("N"), cl::init(10), cl::cat(LLVMEppOptionCategory));
+
+cl::SubCommand mergeCommand("merge",
+                            "Sum several profiles of the same module");
+
+cl::list<string> mergeInputs(cl::Positional, cl::desc("<profile>..."),
+                             cl::sub(mergeCommand),
+                             cl::cat(LLVMEppOptionCategory));
+
+cl::list<string> weightedInputs(
+    "weighted-input",
+    cl::desc("A profile to merge, with its counts multiplied by W"),
+    cl::value_desc("W,filename"), cl::sub(mergeCommand),
+    cl::cat(LLVMEppOptionCategory));
+
+cl::opt<bool> mergeNormalize(
+    "normalize",
+    cl::desc("Scale each profile to the same total count before weighting"),
+    cl::init(false), cl::sub(mergeCommand), cl::cat(LLVMEppOptionCategory));
+
+cl::opt<string> mergeOutput("o", cl::desc("Filename of the merged profile"),
+                            cl::value_desc("filename"), cl::Required,
+                            cl::sub(mergeCommand),
+                            cl::cat(LLVMEppOptionCategory));
+
+cl::opt<ProfileFormat> mergeFormat(
+    "profile-format", cl::desc("Format of the merged profile"),
+    cl::values(clEnumValN(TextProfile, "text", "Human readable text"),
+               clEnumValN(BinaryProfile, "binary", "Compact binary")),
+    cl::init(TextProfile), cl::sub(mergeCommand),
+    cl::cat(LLVMEppOptionCategory));
+
+cl::opt<unsigned> mergeThreads(
+    "j", cl::desc("Number of merging threads, 0 uses one per core"),
+    cl::value_desc("N"), cl::init(0), cl::sub(mergeCommand),
+    cl::cat(LLVMEppOptionCategory));
+
 // cl::opt<bool> wideCounter(
 //     "w",
 //     cl::desc("Use wide (128 bit) counters. Only available on 64 bit
@@ -102,19 +256,52 @@ void saveModule(Module &m, StringRef filename) {
     WriteBitcodeToFile(&m, out);
 }
 
+/// Link the bitcode of the runtime fast path into the instrumented module
+/// and inline it into every log site. Linking happens after instrumentation
+/// so that the runtime itself is never instrumented.
+void linkRuntime(Module &module) {
+    SMDiagnostic err;
+    unique_ptr<Module> runtime =
+        parseIRFile(runtimeBitcode.getValue(), err, module.getContext());
+    if (!runtime) {
+        err.print("llvm-epp", errs());
+        report_fatal_error("error reading runtime bitcode '" +
+                           Twine(runtimeBitcode) + "'");
+    }
+
+    if (Linker::linkModules(module, move(runtime),
+                            Linker::Flags::LinkOnlyNeeded)) {
+        report_fatal_error("error linking runtime bitcode '" +
+                           Twine(runtimeBitcode) + "'");
+    }
+
+    if (auto *F = module.getFunction("__epp_logPathInline")) {
+        F->setLinkage(GlobalValue::InternalLinkage);
+        F->addFnAttr(Attribute::AlwaysInline);
+    }
+
+    legacy::PassManager pm;
+    pm.add(createAlwaysInlinerLegacyPass());
+    pm.add(createVerifierPass());
+    pm.run(module);
+}
+
 void instrumentModule(Module &module) {
 
     // Build up all of the passes that we want to run on the module.
     legacy::PassManager pm;
     pm.add(createLoopSimplifyPass());
     pm.add(new epp::BreakSelfLoopsPass());
-    pm.add(createBreakCriticalEdgesPass());
     pm.add(new epp::SplitLandingPadPredsPass());
     pm.add(new LoopInfoWrapperPass());
     pm.add(new epp::EPPProfile());
     pm.add(createVerifierPass());
     pm.run(module);
 
+    if (!runtimeBitcode.empty()) {
+        linkRuntime(module);
+    }
+
     auto replaceExt = [](string &s, const string &newExt) {
         string::size_type i = s.rfind('.', s.length());
         if (i != string::npos) {
@@ -138,7 +325,6 @@ void interpretResults(Module &module) {
     legacy::PassManager pm;
     pm.add(createLoopSimplifyPass());
     pm.add(new epp::BreakSelfLoopsPass());
-    pm.add(createBreakCriticalEdgesPass());
     pm.add(new epp::SplitLandingPadPredsPass());
     pm.add(new LoopInfoWrapperPass());
     pm.add(new epp::EPPDecode());
@@ -146,6 +332,59 @@ void interpretResults(Module &module) {
     pm.add(createVerifierPass());
     pm.run(module);
 }
+
+/// Rewrite a profile in either format as text.
+void exportTextProfile() {
+    ProfileReader reader;
+    if (!reader.open(profile.c_str())) {
+        report_fatal_error("Could not open profile '" + Twine(profile) + "'");
+    }
+    vector<FunctionProfile> functions;
+    if (!readProfile(reader, functions)) {
+        report_fatal_error("Invalid profile format?");
+    }
+
+    FILE *fp = fopen(exportText.c_str(), "w");
+    if (!fp) {
+        report_fatal_error("error opening '" + Twine(exportText) + "'");
+    }
+    writeTextProfile(fp, functions, reader.info());
+    fclose(fp);
+}
+
+/// Implements the merge subcommand.
+int mergeMain() {
+    vector<MergeInput> inputs;
+    for (auto &path : mergeInputs) {
+        inputs.push_back({path, 1.0});
+    }
+    for (StringRef arg : weightedInputs) {
+        StringRef weight, path;
+        tie(weight, path) = arg.split(',');
+        double w;
+        if (path.empty() || weight.getAsDouble(w) || !(w > 0)) {
+            errs() << "Invalid -weighted-input '" << arg
+                   << "', expected a positive weight and a filename.\n";
+            return -1;
+        }
+        inputs.push_back({path.str(), w});
+    }
+    if (inputs.empty()) {
+        errs() << "No profiles to merge.\n";
+        return -1;
+    }
+
+    MergeOptions options;
+    options.Format    = mergeFormat;
+    options.Normalize = mergeNormalize;
+    options.Threads   = mergeThreads;
+    string error;
+    if (!mergeProfiles(inputs, mergeOutput, options, error)) {
+        errs() << "Error merging profiles: " << error << "\n";
+        return -1;
+    }
+    return 0;
+}
 } // namespace
 
 int main(int argc, char **argv) {
@@ -164,6 +403,26 @@ int main(int argc, char **argv) {
         TargetRegistry::printRegisteredTargetsForVersion);
     cl::ParseCommandLineOptions(argc, argv);
 
+    if (mergeCommand) {
+        return mergeMain();
+    }
+
+    if (samplePeriod && (sampleBurst == 0 || sampleBurst > samplePeriod)) {
+        errs() << "-sample-burst must be between 1 and -sample-period.\n";
+        return -1;
+    }
+
+    // A sampled log site does not know when the next path starts.
+    if (samplePeriod && timedPaths) {
+        errs() << "-timed-paths can not be combined with -sample-period.\n";
+        return -1;
+    }
+
+    if (heavyHitterCapacity == 0) {
+        errs() << "-heavy-hitter-capacity must be at least 1.\n";
+        return -1;
+    }
+
     // Construct an IR file from the filename passed on the command line.
     SMDiagnostic err;
     LLVMContext context;
@@ -175,7 +434,9 @@ int main(int argc, char **argv) {
         return -1;
     }
 
-    if (!profile.empty()) {
+    if (!profile.empty() && !exportText.empty()) {
+        exportTextProfile();
+    } else if (!profile.empty()) {
         interpretResults(*module);
     } else {
         instrumentModule(*module);